@@ -7,6 +7,24 @@
 #include <image_utils.h>
 #include <argument_utils.h>
 #include <mpi.h>
+#include <math.h>
+#include <stddef.h>
+#include <limits.h>
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include "raw_image.h"
+
+#ifndef min
+#define min(x,y) (((x) < (y)) ? (x) : (y))
+#endif
+#ifndef max
+#define max(x,y) (((x) > (y)) ? (x) : (y))
+#endif
 
 /**
  *                      TIMING AND SPEEDUP
@@ -17,6 +35,13 @@
  *  -   4: 0.188s, 0.212s, 0.243s -> avg. 0.214s ->         = 2.85
  *  -   8: 0.127s, 0.154s, 0.133s -> avg. 0.138s ->         = 4.41
  * 
+ * Hybrid, N ranks x M OpenMP threads per rank: build with -fopenmp and run
+ * every mix with N * M = cores per node on the target nodes, e.g. for two
+ * sockets of 16 cores
+ *   OMP_NUM_THREADS=16 mpirun --map-by socket --bind-to socket -np 2 ./main ...
+ *   OMP_NUM_THREADS=1 mpirun --map-by core --bind-to core -np 32 ./main ...
+ * and record the times here as N x M: t1, t2, t3 -> avg. Not measured yet.
+ * 
  **/
 
 
@@ -24,12 +49,458 @@
 // The kernels are defined under argument_utils.h
 // Take a look at this file to get a feel for how the kernels look.
 
+#define kernelCount (sizeof(kernelDims) / sizeof(kernelDims[0]))
+
+//--------------------------------------------------------------------------
+//------------------------convolution engine--------------------------------
+//--------------------------------------------------------------------------
+// The image is split into planar float channels, so a vector holds the same
+// channel of neighbouring pixels. Pixels whose whole kernel window lies
+// inside the image are done with AVX2 and no bounds checks, in column strips
+// narrow enough that the kernelDim rows a strip reads stay in L1. Only the
+// border band of kernelDim/2 pixels clips the window, and it does so per
+// pixel, not per tap. Sums are integers and exact in float, so the results
+// match the scalar loop: (sum * kernelFactor) truncated to 0..255.
+#define CONV_STRIP 512          // Pixels per column strip, kernelDim rows of it fit L1
+#define CONV_VLEN 8
+#define CONV_UNROLL 4           // Vectors in flight per row
+
+typedef struct {
+    unsigned int width, height;
+    float *plane[3];            // r, g, b, width * height each
+} conv_planes;
+
+// A kernel as the engine uses it, see conv_kernel_analyse
+typedef struct {
+    unsigned int dim;
+    float factor;
+    float *k;                   // Flipped, dim * dim
+    bool separable;             // k[y * dim + x] == col[y] * row[x]
+    float *col, *row;           // dim each, integers
+} conv_kernel;
+
+// One per thread, so every thread converts its tiles into its own planes
+static float *conv_buffer = NULL;
+static size_t conv_buffer_size = 0;
+#ifdef _OPENMP
+#pragma omp threadprivate(conv_buffer, conv_buffer_size)
+#endif
+
+// Planes for the input and the output, then `rows` spare rows, kept between calls
+static float *conv_planes_get(conv_planes *in, conv_planes *out, unsigned int width, unsigned int height, unsigned int rows)
+{
+    size_t n = (size_t)width * height;
+    if (6 * n + (size_t)rows * width > conv_buffer_size) {
+        free(conv_buffer);
+        conv_buffer_size = 6 * n + (size_t)rows * width;
+        conv_buffer = aligned_alloc(64, (conv_buffer_size * sizeof(float) + 63) & ~(size_t)63);
+    }
+    in->width = out->width = width;
+    in->height = out->height = height;
+    for (int c = 0; c < 3; c++) {
+        in->plane[c] = conv_buffer + c * n;
+        out->plane[c] = conv_buffer + (3 + c) * n;
+    }
+    return conv_buffer + 6 * n;
+}
+
+// Columns left to left + p->width - 1 of in[0] to in[p->height - 1] to the planes
+static void conv_split(conv_planes *p, pixel **in, unsigned int left)
+{
+    for (unsigned int y = 0; y < p->height; y++) {
+        float *r = p->plane[0] + (size_t)y * p->width;
+        float *g = p->plane[1] + (size_t)y * p->width;
+        float *b = p->plane[2] + (size_t)y * p->width;
+        pixel const *row = in[y] + left;
+        unsigned int x = 0;
+#ifdef __AVX2__
+        // Eight pixels are eight 32-bit lanes, each channel a shift and a mask away
+        __m256i const byte = _mm256_set1_epi32(0xff);
+        for (; x + CONV_VLEN <= p->width; x += CONV_VLEN) {
+            __m256i const v = _mm256_loadu_si256((__m256i const *)(row + x));
+            _mm256_storeu_ps(r + x, _mm256_cvtepi32_ps(_mm256_and_si256(_mm256_srli_epi32(v, 8 * offsetof(pixel, r)), byte)));
+            _mm256_storeu_ps(g + x, _mm256_cvtepi32_ps(_mm256_and_si256(_mm256_srli_epi32(v, 8 * offsetof(pixel, g)), byte)));
+            _mm256_storeu_ps(b + x, _mm256_cvtepi32_ps(_mm256_and_si256(_mm256_srli_epi32(v, 8 * offsetof(pixel, b)), byte)));
+        }
+#endif
+        for (; x < p->width; x++) {
+            r[x] = row[x].r;
+            g[x] = row[x].g;
+            b[x] = row[x].b;
+        }
+    }
+}
+
+// Rows first to first + count - 1 and columns x0 to x1 - 1 of the planes to
+// out[0] to out[count - 1], where plane column 0 is column left of out
+static void conv_merge(pixel **out, conv_planes const *p, unsigned int first, unsigned int count,
+        unsigned int left, unsigned int x0, unsigned int x1)
+{
+    for (unsigned int y = first; y < first + count; y++) {
+        float const *r = p->plane[0] + (size_t)y * p->width;
+        float const *g = p->plane[1] + (size_t)y * p->width;
+        float const *b = p->plane[2] + (size_t)y * p->width;
+        pixel *row = out[y - first] + left;
+        unsigned int x = x0;
+#ifdef __AVX2__
+        // The values are already whole numbers in 0..255
+        __m256i const alpha = _mm256_set1_epi32(255 << (8 * offsetof(pixel, a)));
+        for (; x + CONV_VLEN <= x1; x += CONV_VLEN) {
+            __m256i v = alpha;
+            v = _mm256_or_si256(v, _mm256_slli_epi32(_mm256_cvtps_epi32(_mm256_loadu_ps(r + x)), 8 * offsetof(pixel, r)));
+            v = _mm256_or_si256(v, _mm256_slli_epi32(_mm256_cvtps_epi32(_mm256_loadu_ps(g + x)), 8 * offsetof(pixel, g)));
+            v = _mm256_or_si256(v, _mm256_slli_epi32(_mm256_cvtps_epi32(_mm256_loadu_ps(b + x)), 8 * offsetof(pixel, b)));
+            _mm256_storeu_si256((__m256i *)(row + x), v);
+        }
+#endif
+        for (; x < x1; x++) {
+            row[x].r = (unsigned char)r[x];
+            row[x].g = (unsigned char)g[x];
+            row[x].b = (unsigned char)b[x];
+            row[x].a = 255;
+        }
+    }
+}
+
+static inline float conv_scale(float sum, float kernelFactor)
+{
+    float v = truncf(sum * kernelFactor);
+    return v < 0.0f ? 0.0f : (v > 255.0f ? 255.0f : v);
+}
+
+// One pixel with the window clipped to the image, for the border band
+static void conv_pixel_clipped(float *out, float const *in, unsigned int width, unsigned int height,
+        unsigned int x, unsigned int y, float const *k, unsigned int kernelDim, float kernelFactor)
+{
+    int const c = kernelDim / 2;
+    int const ky0 = (int)y < c ? c - y : 0, ky1 = min((int)kernelDim, (int)height - (int)y + c);
+    int const kx0 = (int)x < c ? c - x : 0, kx1 = min((int)kernelDim, (int)width - (int)x + c);
+    float sum = 0.0f;
+    for (int ky = ky0; ky < ky1; ky++) {
+        float const *row = in + ((ptrdiff_t)y + ky - c) * width + ((ptrdiff_t)x - c);
+        for (int kx = kx0; kx < kx1; kx++)
+            sum += k[ky * kernelDim + kx] * row[kx];
+    }
+    out[(size_t)y * width + x] = conv_scale(sum, kernelFactor);
+}
+
+// Interior pixels x0 <= x < x1 of rows y0 <= y < y1, the window never leaves the image
+static void conv_interior(float *out, float const *in, unsigned int width,
+        unsigned int x0, unsigned int x1, unsigned int y0, unsigned int y1,
+        float const *k, unsigned int kernelDim, float kernelFactor)
+{
+    int const c = kernelDim / 2;
+    for (unsigned int y = y0; y < y1; y++) {
+        float const *top = in + (size_t)(y - c) * width - c;
+        float *o = out + (size_t)y * width;
+        unsigned int x = x0;
+#ifdef __AVX2__
+        __m256 const factor = _mm256_set1_ps(kernelFactor);
+        __m256 const lo = _mm256_setzero_ps(), hi = _mm256_set1_ps(255.0f);
+        // CONV_UNROLL vectors at a time, the FMA chains are latency bound otherwise
+        for (; x + CONV_UNROLL * CONV_VLEN <= x1; x += CONV_UNROLL * CONV_VLEN) {
+            __m256 s[CONV_UNROLL];
+            for (int u = 0; u < CONV_UNROLL; u++)
+                s[u] = _mm256_setzero_ps();
+            for (unsigned int ky = 0; ky < kernelDim; ky++) {
+                float const *row = top + (size_t)ky * width + x;
+                for (unsigned int kx = 0; kx < kernelDim; kx++) {
+                    __m256 const w = _mm256_broadcast_ss(&k[ky * kernelDim + kx]);
+                    for (int u = 0; u < CONV_UNROLL; u++)
+                        s[u] = _mm256_fmadd_ps(w, _mm256_loadu_ps(row + kx + u * CONV_VLEN), s[u]);
+                }
+            }
+            for (int u = 0; u < CONV_UNROLL; u++) {
+                __m256 v = _mm256_round_ps(_mm256_mul_ps(s[u], factor), _MM_FROUND_TO_ZERO | _MM_FROUND_NO_EXC);
+                _mm256_storeu_ps(o + x + u * CONV_VLEN, _mm256_min_ps(_mm256_max_ps(v, lo), hi));
+            }
+        }
+        for (; x + CONV_VLEN <= x1; x += CONV_VLEN) {
+            __m256 s0 = _mm256_setzero_ps();
+            for (unsigned int ky = 0; ky < kernelDim; ky++)
+                for (unsigned int kx = 0; kx < kernelDim; kx++)
+                    s0 = _mm256_fmadd_ps(_mm256_broadcast_ss(&k[ky * kernelDim + kx]),
+                            _mm256_loadu_ps(top + (size_t)ky * width + x + kx), s0);
+            s0 = _mm256_round_ps(_mm256_mul_ps(s0, factor), _MM_FROUND_TO_ZERO | _MM_FROUND_NO_EXC);
+            _mm256_storeu_ps(o + x, _mm256_min_ps(_mm256_max_ps(s0, lo), hi));
+        }
+#endif
+        for (; x < x1; x++) {
+            float sum = 0.0f;
+            for (unsigned int ky = 0; ky < kernelDim; ky++)
+                for (unsigned int kx = 0; kx < kernelDim; kx++)
+                    sum += k[ky * kernelDim + kx] * top[(size_t)ky * width + x + kx];
+            o[x] = conv_scale(sum, kernelFactor);
+        }
+    }
+}
+
+static void conv_plane(float *out, float const *in, unsigned int width, unsigned int height,
+        conv_kernel const *ck)
+{
+    float const *k = ck->k;
+    unsigned int const kernelDim = ck->dim;
+    float const kernelFactor = ck->factor;
+    unsigned int const c = kernelDim / 2;
+
+    // Interior, strip by strip
+    if (width > 2 * c && height > 2 * c)
+        for (unsigned int x0 = c; x0 < width - c; x0 += CONV_STRIP)
+            conv_interior(out, in, width, x0, min(x0 + CONV_STRIP, width - c), c, height - c,
+                    k, kernelDim, kernelFactor);
+
+    // Border band: top and bottom rows, then the left and right columns between them
+    for (unsigned int y = 0; y < height; y++) {
+        bool const full_row = y < c || y + c >= height || width <= 2 * c;
+        for (unsigned int x = 0; x < width; x++) {
+            if (!full_row && x == c) {
+                x = width - c;
+                // No right band for a 1x1 kernel
+                if (x >= width)
+                    break;
+            }
+            conv_pixel_clipped(out, in, width, height, x, y, k, kernelDim, kernelFactor);
+        }
+    }
+}
+
+//--------------------------------------------------------------------------
+//------------------------separable kernels---------------------------------
+//--------------------------------------------------------------------------
+// A rank-1 kernel col * row^T is a horizontal pass with row, then a vertical
+// pass with col: 2 * kernelDim taps per pixel instead of kernelDim^2. Both
+// factors are integers, so the partial sums are too and the result is bit
+// identical to the 2D path. Clipping each pass at the image edge is the same
+// as clipping the 2D window, so there is no separate border code.
+
+static int gcd(int a, int b)
+{
+    while (b) {
+        int t = a % b;
+        a = b;
+        b = t;
+    }
+    return a < 0 ? -a : a;
+}
+
+// Flips kernel and looks for integer factors, once per kernel rather than per call
+void conv_kernel_analyse(conv_kernel *ck, int const *kernel, unsigned int kernelDim, float kernelFactor)
+{
+    unsigned int const n = kernelDim * kernelDim;
+    int flipped[n];
+
+    ck->dim = kernelDim;
+    ck->factor = kernelFactor;
+    ck->k = malloc(sizeof(float) * (n + 2 * kernelDim));
+    ck->col = ck->k + n;
+    ck->row = ck->col + kernelDim;
+
+    // Flipped once here instead of by index arithmetic per tap
+    for (unsigned int i = 0; i < n; i++) {
+        flipped[i] = kernel[n - 1 - i];
+        ck->k[i] = flipped[i];
+    }
+
+    // Any nonzero row, divided by the gcd of its entries, is the row factor
+    // of an integer rank-1 kernel, and every row is an integer multiple of it
+    unsigned int pivot = 0;
+    while (pivot < n && flipped[pivot] == 0)
+        pivot++;
+    ck->separable = pivot < n;
+    if (!ck->separable)
+        return;
+
+    int const *prow = flipped + pivot / kernelDim * kernelDim;
+    unsigned int const px = pivot % kernelDim;
+    int g = 0;
+    for (unsigned int x = 0; x < kernelDim; x++)
+        g = gcd(g, prow[x]);
+    if (prow[px] < 0)
+        g = -g;
+
+    for (unsigned int y = 0; y < kernelDim && ck->separable; y++) {
+        int const r = prow[px] / g;
+        int const cy = flipped[y * kernelDim + px] / r;
+        ck->col[y] = cy;
+        for (unsigned int x = 0; x < kernelDim; x++)
+            if (flipped[y * kernelDim + x] != cy * (prow[x] / g))
+                ck->separable = false;
+    }
+    for (unsigned int x = 0; x < kernelDim; x++)
+        ck->row[x] = prow[x] / g;
+}
+
+void conv_kernel_free(conv_kernel *ck)
+{
+    free(ck->k);
+}
+
+// dst = src convolved with the dim taps of f, clipped at both ends
+static void conv_row_pass(float *restrict dst, float const *restrict src, unsigned int width,
+        float const *f, unsigned int dim)
+{
+    int const c = dim / 2;
+    for (unsigned int x = 0; x < width; x++) {
+        // Only the ends clip, the middle takes the unclipped loop
+        if ((int)x == c && width > 2 * (unsigned int)c) {
+            unsigned int xx = c;
+#ifdef __AVX2__
+            for (; xx + CONV_VLEN <= width - c; xx += CONV_VLEN) {
+                __m256 sum = _mm256_setzero_ps();
+                for (unsigned int kx = 0; kx < dim; kx++)
+                    sum = _mm256_fmadd_ps(_mm256_broadcast_ss(&f[kx]), _mm256_loadu_ps(src + xx + kx - c), sum);
+                _mm256_storeu_ps(dst + xx, sum);
+            }
+#endif
+            for (; xx < width - c; xx++) {
+                float sum = 0.0f;
+                for (unsigned int kx = 0; kx < dim; kx++)
+                    sum += f[kx] * src[xx + kx - c];
+                dst[xx] = sum;
+            }
+            x = width - c - 1;
+            continue;
+        }
+        int const kx0 = (int)x < c ? c - x : 0, kx1 = min((int)dim, (int)width - (int)x + c);
+        float sum = 0.0f;
+        for (int kx = kx0; kx < kx1; kx++)
+            sum += f[kx] * src[(ptrdiff_t)x + kx - c];
+        dst[x] = sum;
+    }
+}
+
+// The horizontal pass goes to a ring of dim rows, each row is computed once
+// and used by the dim output rows around it while it is still in cache
+static void conv_plane_separable(float *out, float const *in, unsigned int width, unsigned int height,
+        conv_kernel const *ck, float *ring)
+{
+    unsigned int const dim = ck->dim, c = dim / 2;
+    unsigned int next = 0;      // Next input row for the horizontal pass
+
+    for (unsigned int y = 0; y < height; y++) {
+        for (; next < height && next <= y + c; next++)
+            conv_row_pass(ring + (size_t)(next % dim) * width, in + (size_t)next * width, width, ck->row, dim);
+
+        // The rows of the window that are inside the image
+        float const *h[dim];
+        float w[dim];
+        unsigned int taps = 0;
+        for (unsigned int ky = 0; ky < dim; ky++) {
+            int const yy = (int)y + (int)ky - (int)c;
+            if (yy >= 0 && yy < (int)height) {
+                h[taps] = ring + (size_t)(yy % dim) * width;
+                w[taps++] = ck->col[ky];
+            }
+        }
+
+        float *o = out + (size_t)y * width;
+        unsigned int x = 0;
+#ifdef __AVX2__
+        __m256 const factor = _mm256_set1_ps(ck->factor);
+        __m256 const lo = _mm256_setzero_ps(), hi = _mm256_set1_ps(255.0f);
+        for (; x + CONV_VLEN <= width; x += CONV_VLEN) {
+            __m256 sum = _mm256_setzero_ps();
+            for (unsigned int t = 0; t < taps; t++)
+                sum = _mm256_fmadd_ps(_mm256_broadcast_ss(&w[t]), _mm256_loadu_ps(h[t] + x), sum);
+            sum = _mm256_round_ps(_mm256_mul_ps(sum, factor), _MM_FROUND_TO_ZERO | _MM_FROUND_NO_EXC);
+            _mm256_storeu_ps(o + x, _mm256_min_ps(_mm256_max_ps(sum, lo), hi));
+        }
+#endif
+        for (; x < width; x++) {
+            float sum = 0.0f;
+            for (unsigned int t = 0; t < taps; t++)
+                sum += w[t] * h[t][x];
+            o[x] = conv_scale(sum, ck->factor);
+        }
+    }
+}
+
+
+// Apply an analysed kernel to columns x0 to x1 - 1 of rows y0 to y1 - 1 of
+// image data that is width x height, so nothing further than kernelDim/2
+// outside the rectangle is read. Only that context around the rectangle is
+// converted and convolved along with it, and only the rectangle is written.
+static void conv_rect(pixel **out, pixel **in, unsigned int width, unsigned int height, conv_kernel const *ck,
+        unsigned int x0, unsigned int x1, unsigned int y0, unsigned int y1) {
+    conv_planes src, dst;
+    if (x0 >= x1 || y0 >= y1)
+        return;
+
+    unsigned int const c = ck->dim / 2;
+    unsigned int const lo = y0 > c ? y0 - c : 0, hi = min(y1 + c, height);
+    unsigned int const left = x0 > c ? x0 - c : 0, right = min(x1 + c, width);
+
+    // Clipping at the edges of the context is clipping at the image edges,
+    // or falls on context pixels that are not written back
+    float *ring = conv_planes_get(&src, &dst, right - left, hi - lo, ck->dim);
+    conv_split(&src, in + lo, left);
+    for (int p = 0; p < 3; p++) {
+        if (ck->separable)
+            conv_plane_separable(dst.plane[p], src.plane[p], right - left, hi - lo, ck, ring);
+        else
+            conv_plane(dst.plane[p], src.plane[p], right - left, hi - lo, ck);
+    }
+    conv_merge(out + y0, &dst, y0 - lo, y1 - y0, left, x0 - left, x1 - left);
+}
+
+// As conv_rect, tiled over the OpenMP threads. Tiles are bands of rows of at
+// least kernelDim rows, so the context each one converts twice stays small,
+// or, for rectangles too flat for that, columns of a few vectors. The thread
+// team only exists inside this call, MPI is never called from it.
+void applyConvKernelRect(pixel **out, pixel **in, unsigned int width, unsigned int height, conv_kernel const *ck,
+        unsigned int x0, unsigned int x1, unsigned int y0, unsigned int y1) {
+    if (x0 >= x1 || y0 >= y1)
+        return;
+#ifdef _OPENMP
+    unsigned int const rows = y1 - y0, cols = x1 - x0;
+    unsigned int const threads = omp_get_max_threads();
+    unsigned int const by_rows = rows / ck->dim, by_cols = cols / (CONV_VLEN * CONV_UNROLL);
+    bool const across = by_rows < threads && by_cols > by_rows;
+    int const tiles = min(threads, across ? by_cols : by_rows);
+
+    if (tiles > 1) {
+        #pragma omp parallel for schedule(static) num_threads(tiles)
+        for (int t = 0; t < tiles; t++) {
+            if (across)
+                conv_rect(out, in, width, height, ck,
+                        x0 + (size_t)cols * t / tiles, x0 + (size_t)cols * (t + 1) / tiles, y0, y1);
+            else
+                conv_rect(out, in, width, height, ck,
+                        x0, x1, y0 + (size_t)rows * t / tiles, y0 + (size_t)rows * (t + 1) / tiles);
+        }
+        return;
+    }
+#endif
+    conv_rect(out, in, width, height, ck, x0, x1, y0, y1);
+}
+
+// Apply an analysed kernel to rows y0 to y1 - 1 of image data
+void applyConvKernelRows(pixel **out, pixel **in, unsigned int width, unsigned int height, conv_kernel const *ck,
+        unsigned int y0, unsigned int y1) {
+    applyConvKernelRect(out, in, width, height, ck, 0, width, y0, y1);
+}
+
+// Apply an analysed kernel on image data
+void applyConvKernel(pixel **out, pixel **in, unsigned int width, unsigned int height, conv_kernel const *ck) {
+    applyConvKernelRows(out, in, width, height, ck, 0, height);
+}
+
 // Apply convolutional kernel on image data
 void applyKernel(pixel **out, pixel **in, unsigned int width, unsigned int height, int *kernel, unsigned int kernelDim, float kernelFactor) {
+    conv_kernel ck;
+    conv_kernel_analyse(&ck, kernel, kernelDim, kernelFactor);
+    applyConvKernel(out, in, width, height, &ck);
+    conv_kernel_free(&ck);
+}
+
+#ifdef CONV_BENCHMARK
+// The original per-tap bounds checked loop, with signed sums so negative
+// results clamp to 0 like the engine's. For checking and timing the engine.
+void applyKernelReference(pixel **out, pixel **in, unsigned int width, unsigned int height, int *kernel, unsigned int kernelDim, float kernelFactor) {
     unsigned int const kernelCenter = (kernelDim / 2);
     for (unsigned int imageY = 0; imageY < height; imageY++) {
         for (unsigned int imageX = 0; imageX < width; imageX++) {
-            unsigned int ar = 0, ag = 0, ab = 0;
+            int ar = 0, ag = 0, ab = 0;
             for (unsigned int kernelY = 0; kernelY < kernelDim; kernelY++) {
                 int nky = kernelDim - 1 - kernelY;
                 for (unsigned int kernelX = 0; kernelX < kernelDim; kernelX++) {
@@ -44,28 +515,517 @@ void applyKernel(pixel **out, pixel **in, unsigned int width, unsigned int heigh
                     }
                 }
             }
-            if (ar || ag || ab) {
-                ar *= kernelFactor;
-                ag *= kernelFactor;
-                ab *= kernelFactor;
-                out[imageY][imageX].r = (ar > 255) ? 255 : ar;
-                out[imageY][imageX].g = (ag > 255) ? 255 : ag;
-                out[imageY][imageX].b = (ab > 255) ? 255 : ab;
-                out[imageY][imageX].a = 255;
-            } else {
-                out[imageY][imageX].r = 0;
-                out[imageY][imageX].g = 0;
-                out[imageY][imageX].b = 0;
-                out[imageY][imageX].a = 255;
-            }
+            out[imageY][imageX].r = (unsigned char)conv_scale(ar, kernelFactor);
+            out[imageY][imageX].g = (unsigned char)conv_scale(ag, kernelFactor);
+            out[imageY][imageX].b = (unsigned char)conv_scale(ab, kernelFactor);
+            out[imageY][imageX].a = 255;
         }
     }
 }
 
+#define CONV_BENCH_REPS 5         // Timed calls per variant, after one untimed warm-up
+
+typedef struct {
+    image_t *image, *out;
+    unsigned int index;         // In kernels, for the reference
+    conv_kernel const *ck;      // For the engine
+} conv_bench;
+
+static void conv_bench_reference(conv_bench const *b)
+{
+    applyKernelReference(b->out->data, b->image->data, b->image->width, b->image->height,
+            kernels[b->index], kernelDims[b->index], kernelFactors[b->index]);
+}
+
+static void conv_bench_engine(conv_bench const *b)
+{
+    applyConvKernel(b->out->data, b->image->data, b->image->width, b->image->height, b->ck);
+}
+
+// Median seconds of CONV_BENCH_REPS calls. The warm-up takes the engine's
+// scratch allocation and first-touch page faults out of the timing.
+static double conv_bench_median(void (*run)(conv_bench const *), conv_bench const *b)
+{
+    double times[CONV_BENCH_REPS];
+    run(b);
+    for (int r = 0; r < CONV_BENCH_REPS; r++) {
+        double const t0 = MPI_Wtime();
+        run(b);
+        double t = MPI_Wtime() - t0;
+        int j = r;
+        for (; j > 0 && times[j - 1] > t; j--)
+            times[j] = times[j - 1];
+        times[j] = t;
+    }
+    return times[CONV_BENCH_REPS / 2];
+}
+
+// Megapixels per second of both versions for every kernel on image, and whether they agree
+void benchmarkKernels(image_t *image)
+{
+    image_t *ref = newImage(image->width, image->height);
+    image_t *out = newImage(image->width, image->height);
+    double const mp = 1e-6 * image->width * image->height;
+
+    printf("Median of %d calls after a warm-up:\n", CONV_BENCH_REPS);
+    for (unsigned int i = 0; i < kernelCount; i++) {
+        conv_kernel ck;
+        conv_kernel_analyse(&ck, kernels[i], kernelDims[i], kernelFactors[i]);
+        bool const separable = ck.separable;
+        conv_bench const reference = {image, ref, i, &ck}, engine = {image, out, i, &ck};
+
+        // The 2D path even for separable kernels, for comparison
+        ck.separable = false;
+        double const t_ref = conv_bench_median(conv_bench_reference, &reference);
+        double const t_engine = conv_bench_median(conv_bench_engine, &engine);
+        bool same = memcmp(ref->rawdata, out->rawdata, sizeof(pixel) * image->width * image->height) == 0;
+
+        printf("%-16s %ux%u\tReference: %8.1f MP/s\tEngine: %8.1f MP/s", kernelNames[i],
+                kernelDims[i], kernelDims[i], mp / t_ref, mp / t_engine);
+        if (separable) {
+            ck.separable = true;
+            double const t_separable = conv_bench_median(conv_bench_engine, &engine);
+            same = same && memcmp(ref->rawdata, out->rawdata, sizeof(pixel) * image->width * image->height) == 0;
+            printf("\tSeparable: %8.1f MP/s", mp / t_separable);
+        }
+        printf("\t%s\n", same ? "identical" : "DIFFERENT");
+        conv_kernel_free(&ck);
+    }
+    freeImage(ref);
+    freeImage(out);
+}
+#endif
+
+//--------------------------------------------------------------------------
+//------------------------domain decomposition------------------------------
+//--------------------------------------------------------------------------
+// The image is cut into a grid of blocks, one per rank of a 2D Cartesian
+// communicator. A rank keeps its block inside a buffer with `halo` rows and
+// columns of the neighbouring blocks on every side, so the buffer is
+// (width + 2 halo) x (height + 2 halo). Every halo, and the block itself, is
+// an MPI_Type_vector into that buffer, so the exchange, the scatter and the
+// gather send straight from and to the image rows without packing.
+
+// Up, down, left, right and the corners, ordered so that i ^ 1 is the opposite of i
+#define GRID_NEIGHBOURS 8
+static int const grid_direction[GRID_NEIGHBOURS][2] = {
+    {-1, 0}, {1, 0}, {0, -1}, {0, 1}, {-1, -1}, {1, 1}, {-1, 1}, {1, -1}
+};
+
+typedef struct {
+    MPI_Comm comm;
+    int rank, size;
+    int dims[2];                            // Blocks down and across
+    unsigned int image_width, image_height;
+    unsigned int x, y, width, height;       // This rank's block
+    unsigned int halo;
+    unsigned int max_halo;                  // The thinnest block across a cut, deeper halos would need a second neighbour
+    int neighbour[GRID_NEIGHBOURS];         // MPI_PROC_NULL past the edges of the image
+    MPI_Datatype pixel_type;
+    MPI_Datatype block_type;                // The block inside the buffer
+    MPI_Datatype halo_type[GRID_NEIGHBOURS];
+    size_t send_offset[GRID_NEIGHBOURS], recv_offset[GRID_NEIGHBOURS];  // In pixels from the buffer start
+} block_grid;
+
+// Part i of n split into parts, the first n % parts are one longer
+static void grid_split(unsigned int n, int parts, int i, unsigned int *first, unsigned int *count)
+{
+    *count = n / parts + (i < (int)(n % parts));
+    *first = i * (n / parts) + min(i, (int)(n % parts));
+}
+
+// The block of the grid at coords
+static void grid_block(block_grid const *g, int const *coords,
+        unsigned int *x, unsigned int *y, unsigned int *width, unsigned int *height)
+{
+    grid_split(g->image_height, g->dims[0], coords[0], y, height);
+    grid_split(g->image_width, g->dims[1], coords[1], x, width);
+}
+
+/*
+ * The dims[0] x dims[1] grid with the smallest halo per block, a block
+ * exchanges width rows with each neighbour above and below and height columns
+ * with each one to the side. Row strips win ties, they are contiguous.
+ * A halo only comes from the adjacent blocks, so across every cut each block
+ * has to be at least `border` thick; the run is aborted if no grid is.
+ * Ranks keep their MPI_COMM_WORLD number, so rank 0 is still the one with the
+ * image.
+ */
+void block_grid_create(block_grid *g, MPI_Comm comm, unsigned int image_width, unsigned int image_height,
+        unsigned int border)
+{
+    MPI_Comm_size(comm, &g->size);
+
+    unsigned long best = (unsigned long)-1;
+    g->dims[0] = g->dims[1] = 0;
+    for (int rows = g->size; rows >= 1; rows--) {
+        int const cols = g->size / rows;
+        if (rows * cols != g->size)
+            continue;
+        if ((rows > 1 && image_height / rows < max(border, 1)) || (cols > 1 && image_width / cols < max(border, 1)))
+            continue;
+        unsigned long const h = (image_height + rows - 1) / rows, w = (image_width + cols - 1) / cols;
+        unsigned long const halo = (rows > 1 ? 2 * w : 0) + (cols > 1 ? 2 * h : 0);
+        if (halo < best) {
+            best = halo;
+            g->dims[0] = rows;
+            g->dims[1] = cols;
+        }
+    }
+    if (g->dims[0] == 0) {
+        int rank;
+        MPI_Comm_rank(comm, &rank);
+        if (rank == 0)
+            fprintf(stderr, "A %u x %u image has no grid of %d blocks that are all at least %u pixels thick, use fewer ranks\n",
+                    image_width, image_height, g->size, border);
+        MPI_Abort(comm, EXIT_FAILURE);
+    }
+
+    // One block needs no halo from anyone, so only its own depth
+    g->max_halo = border;
+    if (g->dims[0] > 1 || g->dims[1] > 1)
+        g->max_halo = min(g->dims[0] > 1 ? image_height / g->dims[0] : UINT_MAX,
+                g->dims[1] > 1 ? image_width / g->dims[1] : UINT_MAX);
+
+    int const periods[2] = {0, 0};
+    MPI_Cart_create(comm, 2, g->dims, periods, 0, &g->comm);
+    MPI_Comm_rank(g->comm, &g->rank);
+
+    int coords[2];
+    MPI_Cart_coords(g->comm, g->rank, 2, coords);
+    g->image_width = image_width;
+    g->image_height = image_height;
+    grid_block(g, coords, &g->x, &g->y, &g->width, &g->height);
+
+    for (int d = 0; d < GRID_NEIGHBOURS; d++) {
+        int const n[2] = {coords[0] + grid_direction[d][0], coords[1] + grid_direction[d][1]};
+        g->neighbour[d] = MPI_PROC_NULL;
+        if (n[0] >= 0 && n[0] < g->dims[0] && n[1] >= 0 && n[1] < g->dims[1])
+            MPI_Cart_rank(g->comm, n, &g->neighbour[d]);
+    }
+
+    MPI_Type_contiguous(sizeof(pixel), MPI_BYTE, &g->pixel_type);
+    MPI_Type_commit(&g->pixel_type);
+    g->block_type = MPI_DATATYPE_NULL;
+    for (int d = 0; d < GRID_NEIGHBOURS; d++)
+        g->halo_type[d] = MPI_DATATYPE_NULL;
+    g->halo = 0;
+}
+
+static void block_grid_free_types(block_grid *g)
+{
+    if (g->block_type != MPI_DATATYPE_NULL)
+        MPI_Type_free(&g->block_type);
+    for (int d = 0; d < GRID_NEIGHBOURS; d++)
+        if (g->halo_type[d] != MPI_DATATYPE_NULL)
+            MPI_Type_free(&g->halo_type[d]);
+}
+
+// Types and offsets for a buffer with a halo of the given depth
+void block_grid_set_halo(block_grid *g, unsigned int halo)
+{
+    block_grid_free_types(g);
+    g->halo = halo;
+
+    unsigned int const D = halo, stride = g->width + 2 * D;
+    MPI_Type_vector(g->height, g->width, stride, g->pixel_type, &g->block_type);
+    MPI_Type_commit(&g->block_type);
+
+    for (int d = 0; d < GRID_NEIGHBOURS; d++) {
+        int const dy = grid_direction[d][0], dx = grid_direction[d][1];
+        if (D == 0 || g->neighbour[d] == MPI_PROC_NULL)
+            continue;
+        // D deep towards the neighbour, the length of the block along it
+        MPI_Type_vector(dy ? D : g->height, dx ? D : g->width, stride, g->pixel_type, &g->halo_type[d]);
+        MPI_Type_commit(&g->halo_type[d]);
+        // The last D rows or columns of the block go down or right, the halo past them comes back
+        unsigned int const send_y = dy > 0 ? g->height : D, send_x = dx > 0 ? g->width : D;
+        unsigned int const recv_y = dy < 0 ? 0 : dy > 0 ? D + g->height : D;
+        unsigned int const recv_x = dx < 0 ? 0 : dx > 0 ? D + g->width : D;
+        g->send_offset[d] = (size_t)send_y * stride + send_x;
+        g->recv_offset[d] = (size_t)recv_y * stride + recv_x;
+    }
+}
+
+void block_grid_free(block_grid *g)
+{
+    block_grid_free_types(g);
+    MPI_Type_free(&g->pixel_type);
+    MPI_Comm_free(&g->comm);
+}
+
+// Start filling the halo of buf from the neighbours, complete all 2 * GRID_NEIGHBOURS requests
+void block_grid_exchange(block_grid const *g, image_t *buf, MPI_Request *requests)
+{
+    for (int d = 0; d < GRID_NEIGHBOURS; d++) {
+        requests[2 * d] = requests[2 * d + 1] = MPI_REQUEST_NULL;
+        if (g->halo_type[d] == MPI_DATATYPE_NULL)
+            continue;
+        // Tagged with the direction the message travels
+        MPI_Irecv(buf->rawdata + g->recv_offset[d], 1, g->halo_type[d], g->neighbour[d], d ^ 1, g->comm, &requests[2 * d]);
+        MPI_Isend(buf->rawdata + g->send_offset[d], 1, g->halo_type[d], g->neighbour[d], d, g->comm, &requests[2 * d + 1]);
+    }
+}
+
+// The first pixel of the block in a buffer with the grid's halo
+static pixel *block_grid_origin(block_grid const *g, image_t *buf)
+{
+    return buf->rawdata + (size_t)g->halo * (g->width + 2 * g->halo) + g->halo;
+}
+
+// Every block of root's image to the buffer of its rank, or all of them back
+// with gather. An MPI_Alltoallw in which only root sends, or receives, one
+// strided block per rank.
+static void block_grid_transfer(block_grid const *g, image_t *image, image_t *buf, int root, bool gather)
+{
+    int counts[g->size], displs[g->size], zeros[g->size];
+    MPI_Datatype types[g->size], block_types[g->size];
+
+    for (int r = 0; r < g->size; r++) {
+        counts[r] = displs[r] = zeros[r] = 0;
+        types[r] = block_types[r] = g->pixel_type;
+    }
+    if (g->rank == root) {
+        for (int r = 0; r < g->size; r++) {
+            int coords[2];
+            unsigned int x, y, width, height;
+            MPI_Cart_coords(g->comm, r, 2, coords);
+            grid_block(g, coords, &x, &y, &width, &height);
+            MPI_Type_vector(height, width, g->image_width, g->pixel_type, &types[r]);
+            MPI_Type_commit(&types[r]);
+            counts[r] = 1;
+            displs[r] = ((size_t)y * g->image_width + x) * sizeof(pixel);
+        }
+    }
+
+    int mine[g->size];
+    for (int r = 0; r < g->size; r++)
+        mine[r] = r == root;
+    block_types[root] = g->block_type;
+
+    pixel *block = block_grid_origin(g, buf);
+    if (gather)
+        MPI_Alltoallw(block, mine, zeros, block_types, image->rawdata, counts, displs, types, g->comm);
+    else
+        MPI_Alltoallw(image->rawdata, counts, displs, types, block, mine, zeros, block_types, g->comm);
+
+    if (g->rank == root)
+        for (int r = 0; r < g->size; r++)
+            MPI_Type_free(&types[r]);
+}
+
+void block_grid_scatter(block_grid const *g, image_t *image, image_t *buf, int root)
+{
+    block_grid_transfer(g, image, buf, root, false);
+}
+
+void block_grid_gather(block_grid const *g, image_t *image, image_t *buf, int root)
+{
+    block_grid_transfer(g, image, buf, root, true);
+}
+
+
+//--------------------------------------------------------------------------
+//------------------------parallel I/O--------------------------------------
+//--------------------------------------------------------------------------
+// Raw images (raw_image.h) are read and written by all ranks at once, each
+// rank its own block through a subarray file view, so there is no scatter or
+// gather and no rank needs memory for more than its block.
+
+// Every rank gets root's copy of a string allocated with malloc
+static void bcast_string(char **s, int root, MPI_Comm comm)
+{
+    int rank, length = *s ? strlen(*s) + 1 : 0;
+    MPI_Comm_rank(comm, &rank);
+    MPI_Bcast(&length, 1, MPI_INT, root, comm);
+    if (rank != root)
+        *s = length ? malloc(length) : NULL;
+    if (length)
+        MPI_Bcast(*s, length, MPI_CHAR, root, comm);
+}
+
+static void raw_image_fail(MPI_Comm comm, char const *what, char const *name)
+{
+    int rank;
+    MPI_Comm_rank(comm, &rank);
+    if (rank == 0)
+        fprintf(stderr, "Could not %s raw image '%s'!\n", what, name);
+    MPI_Abort(comm, EXIT_FAILURE);
+}
+
+// The size of a raw image, collective over comm
+void raw_image_size(MPI_Comm comm, char const *name, unsigned int *width, unsigned int *height)
+{
+    MPI_File fh;
+    raw_image_header header;
+    if (MPI_File_open(comm, name, MPI_MODE_RDONLY, MPI_INFO_NULL, &fh) != MPI_SUCCESS)
+        raw_image_fail(comm, "open", name);
+    MPI_Offset file_size = 0;
+    int err = MPI_File_read_at_all(fh, 0, &header, sizeof(header), MPI_BYTE, MPI_STATUS_IGNORE);
+    if (err == MPI_SUCCESS)
+        err = MPI_File_get_size(fh, &file_size);
+    MPI_File_close(&fh);
+    // Reads past the end succeed short, so a truncated file has to be caught here.
+    // The sizes also go to MPI as int.
+    if (err != MPI_SUCCESS || !raw_image_header_valid(&header)
+            || header.width > INT_MAX || header.height > INT_MAX
+            || file_size != (MPI_Offset)sizeof(header) + (MPI_Offset)header.width * header.height * sizeof(pixel))
+        raw_image_fail(comm, "read", name);
+    *width = header.width;
+    *height = header.height;
+}
+
+// The part of the file that is this rank's block, past the header
+static void raw_image_view(block_grid const *g, MPI_File fh, MPI_Datatype *view)
+{
+    int const sizes[2] = {g->image_height, g->image_width};
+    int const subsizes[2] = {g->height, g->width};
+    int const starts[2] = {g->y, g->x};
+    MPI_Type_create_subarray(2, sizes, subsizes, starts, MPI_ORDER_C, g->pixel_type, view);
+    MPI_Type_commit(view);
+    MPI_File_set_view(fh, sizeof(raw_image_header), g->pixel_type, *view, "native", MPI_INFO_NULL);
+}
+
+// Every rank's block of a raw image into its buffer, leaving the halo
+void raw_image_read_blocks(block_grid const *g, char const *name, image_t *buf)
+{
+    MPI_File fh;
+    MPI_Datatype view;
+    if (MPI_File_open(g->comm, name, MPI_MODE_RDONLY, MPI_INFO_NULL, &fh) != MPI_SUCCESS)
+        raw_image_fail(g->comm, "open", name);
+    raw_image_view(g, fh, &view);
+    int err = MPI_File_read_at_all(fh, 0, block_grid_origin(g, buf), 1, g->block_type, MPI_STATUS_IGNORE);
+    MPI_File_close(&fh);
+    MPI_Type_free(&view);
+    if (err != MPI_SUCCESS)
+        raw_image_fail(g->comm, "read", name);
+}
+
+// Every rank's block from its buffer to a raw image of the whole grid
+void raw_image_write_blocks(block_grid const *g, char const *name, image_t *buf)
+{
+    MPI_File fh;
+    MPI_Datatype view;
+    raw_image_header header;
+    raw_image_header_init(&header, g->image_width, g->image_height);
+    if (MPI_File_open(g->comm, name, MPI_MODE_WRONLY | MPI_MODE_CREATE, MPI_INFO_NULL, &fh) != MPI_SUCCESS)
+        raw_image_fail(g->comm, "create", name);
+
+    // Cut off whatever a bigger image left there, then the header from one rank
+    int err = MPI_File_set_size(fh, sizeof(header) + (MPI_Offset)g->image_width * g->image_height * sizeof(pixel));
+    if (err == MPI_SUCCESS && g->rank == 0)
+        err = MPI_File_write_at(fh, 0, &header, sizeof(header), MPI_BYTE, MPI_STATUS_IGNORE);
+
+    raw_image_view(g, fh, &view);
+    int const block_err = MPI_File_write_at_all(fh, 0, block_grid_origin(g, buf), 1, g->block_type, MPI_STATUS_IGNORE);
+    MPI_File_close(&fh);
+    MPI_Type_free(&view);
+
+    int failed = err != MPI_SUCCESS || block_err != MPI_SUCCESS, any;
+    MPI_Allreduce(&failed, &any, 1, MPI_INT, MPI_LOR, g->comm);
+    if (any)
+        raw_image_fail(g->comm, "write", name);
+}
+
+
+//--------------------------------------------------------------------------
+//------------------------temporal blocking---------------------------------
+//--------------------------------------------------------------------------
+// With a halo of T * num_border_rows, T iterations can run between
+// exchanges: each one leaves num_border_rows fewer valid rows and columns at
+// every side that has a neighbour, and after T only the block itself is left.
+// That is T times fewer messages for (T - 1 - t) * num_border_rows redundant
+// rows and columns per side in step t, (T - 1) / 2 * num_border_rows per side
+// and iteration on average.
+
+// Takes -T <n> out of argv before parse_args sees it, 0 (tune) if absent
+static unsigned int take_temporal_flag(int *argc, char **argv)
+{
+    unsigned int T = 0;
+    for (int i = 1; i < *argc; i++) {
+        int drop = 0;
+        if (strcmp(argv[i], "-T") == 0 && i + 1 < *argc) {
+            T = strtoul(argv[i + 1], NULL, 10);
+            drop = 2;
+        } else if (strncmp(argv[i], "-T", 2) == 0 && argv[i][2] >= '0' && argv[i][2] <= '9') {
+            T = strtoul(argv[i] + 2, NULL, 10);
+            drop = 1;
+        }
+        if (drop) {
+            memmove(&argv[i], &argv[i + drop], sizeof(char *) * (*argc - i - drop + 1));
+            *argc -= drop;
+            break;
+        }
+    }
+    return T;
+}
+
+// T with the least exchange time plus redundant convolution per iteration,
+// from a timed exchange of a num_border_rows deep halo and a timed
+// convolution of the block on every rank, the slowest of each counts. At
+// most max_T. Leaves the grid with a halo of num_border_rows.
+static unsigned int tune_temporal_blocking(block_grid *g, conv_kernel const *ck, unsigned int border,
+        unsigned int max_T)
+{
+    if (border == 0 || g->size == 1)
+        return 1;
+
+    block_grid_set_halo(g, border);
+    unsigned int const width = g->width + 2 * border, height = g->height + 2 * border;
+    image_t *a = newImage(width, height), *b = newImage(width, height);
+    int const reps = 8;
+    double times[2], slowest[2];
+
+    MPI_Barrier(g->comm);
+    double t0 = MPI_Wtime();
+    for (int r = 0; r < reps; r++) {
+        MPI_Request requests[2 * GRID_NEIGHBOURS];
+        block_grid_exchange(g, a, requests);
+        MPI_Waitall(2 * GRID_NEIGHBOURS, requests, MPI_STATUSES_IGNORE);
+    }
+    times[0] = (MPI_Wtime() - t0) / reps;
+
+    // The fastest of a few after a first call, which allocates and first touches the engine's scratch
+    double convolution = 0.0;
+    for (int r = 0; r <= 3; r++) {
+        t0 = MPI_Wtime();
+        applyConvKernelRect(b->data, a->data, width, height, ck, border, border + g->width, border, border + g->height);
+        double const t = MPI_Wtime() - t0;
+        if (r == 1 || (r > 1 && t < convolution))
+            convolution = t;
+    }
+    // Time of one redundant row or column of depth along every side with a neighbour
+    double const per_pixel = convolution / ((double)g->width * g->height);
+    unsigned int sides = 0;
+    for (int d = 0; d < 4; d++)
+        if (g->neighbour[d] != MPI_PROC_NULL)
+            sides += grid_direction[d][0] ? g->width : g->height;
+    times[1] = per_pixel * sides;
+
+    MPI_Allreduce(times, slowest, 2, MPI_DOUBLE, MPI_MAX, g->comm);
+    freeImage(a);
+    freeImage(b);
+
+    // A block of T redundantly convolves border * (T - 1) / 2 extra rows and columns per side and iteration
+    unsigned int T = 1;
+    double best = slowest[0];
+    for (unsigned int t = 2; t <= max_T; t++) {
+        double cost = slowest[0] / t + border * (t - 1) / 2.0 * slowest[1];
+        if (cost < best) {
+            best = cost;
+            T = t;
+        }
+    }
+    return T;
+}
+
+
 int main(int argc, char **argv) {
 
 
-    MPI_Init(&argc, &argv);
+    // Threads convolve, only the main thread talks MPI
+    int thread_support;
+    MPI_Init_thread(&argc, &argv, MPI_THREAD_FUNNELED, &thread_support);
 
     int world_sz;
     int world_rank;
@@ -73,9 +1033,22 @@ int main(int argc, char **argv) {
     MPI_Comm_size(MPI_COMM_WORLD, &world_sz);
     MPI_Comm_rank(MPI_COMM_WORLD, &world_rank);
 
+    int threads = 1;
+#ifdef _OPENMP
+    if (thread_support < MPI_THREAD_FUNNELED) {
+        if (world_rank == 0)
+            fprintf(stderr, "MPI does not support MPI_THREAD_FUNNELED, running one thread per rank\n");
+        omp_set_num_threads(1);
+    }
+    threads = omp_get_max_threads();
+#endif
+
     OPTIONS my_options;
     OPTIONS *options = &my_options;
 
+    // Iterations per halo exchange, 0 to tune it
+    unsigned int temporal_block = take_temporal_flag(&argc, argv);
+
     if ( world_rank == 0 ) {
         options = parse_args(argc, argv);
 
@@ -92,6 +1065,11 @@ int main(int argc, char **argv) {
         options->input = NULL;
         options->output = NULL;
     }
+    // Raw images are read and written by every rank
+    bcast_string(&options->input, 0, MPI_COMM_WORLD);
+    bcast_string(&options->output, 0, MPI_COMM_WORLD);
+    bool const raw_input = raw_image_name(options->input);
+    bool const raw_output = raw_image_name(options->output);
 
     image_t dummy;
     dummy.rawdata = NULL;
@@ -100,7 +1078,12 @@ int main(int argc, char **argv) {
     image_t *image = &dummy;
     image_t *my_image;
 
-    if( world_rank == 0 ) {
+    if (raw_input) {
+        raw_image_size(MPI_COMM_WORLD, options->input, &dummy.width, &dummy.height);
+        // Only a bmp output is gathered on rank 0
+        if (world_rank == 0 && !raw_output)
+            image = newImage(dummy.width, dummy.height);
+    } else if( world_rank == 0 ) {
         image = loadImage(options->input);
         if (image == NULL) {
             fprintf(stderr, "Could not load bmp image '%s'!\n", options->input);
@@ -115,6 +1098,11 @@ int main(int argc, char **argv) {
                 image->width,
                 image->height,
                 options->iterations);
+        printf("Ranks: %d, threads per rank: %d\n", world_sz, threads);
+#ifdef CONV_BENCHMARK
+        if (image->rawdata != NULL)
+            benchmarkKernels(image);
+#endif
     }
 
     // Broadcast image information
@@ -128,75 +1116,55 @@ int main(int argc, char **argv) {
     //////////////////////////////////////////////////////////
     // Calculate how much of the image to send to each rank //
     //////////////////////////////////////////////////////////
-    int rows_to_receive[world_sz];
-    int bytes_to_transfer[world_sz];
-    int displacements[world_sz];
-    displacements[0] = 0;
-
-    int rows_per_rank = image->height / world_sz;
-    int remainder_rows = image->height % world_sz;
-
-    for(int i = 0; i < world_sz; i++)
-    {
-        int rows_this_rank = rows_per_rank;
-
-        if ( i < remainder_rows ) {
-            rows_this_rank++;
-        }
-
-        int bytes_this_rank = rows_this_rank * image->width * sizeof(pixel);
+    // A 2D grid of blocks, whose halo grows with the block's perimeter
+    // rather than with the image width
+    int num_border_rows = (kernelDims[options->kernelIndex] - 1 ) / 2;
 
-        rows_to_receive[i] = rows_this_rank;
-        bytes_to_transfer[i] = bytes_this_rank;
+    block_grid grid;
+    block_grid_create(&grid, MPI_COMM_WORLD, image->width, image->height, num_border_rows);
 
-        if(i > 0) {
-            displacements[i] = displacements[i - 1] + bytes_to_transfer[i - 1];
-        }
+    // Flipped and, if it is separable, factorised once for all iterations
+    conv_kernel kernel;
+    conv_kernel_analyse(&kernel,
+            kernels[options->kernelIndex],
+            kernelDims[options->kernelIndex],
+            kernelFactors[options->kernelIndex]);
+    if (world_rank == 0 && kernel.separable)
+        printf("Kernel '%s' is separable, applied as two 1D passes\n", kernelNames[options->kernelIndex]);
 
+    // The halo has to come from the neighbours' own pixels, so it is at most as deep as the thinnest block
+    unsigned int const max_block = num_border_rows ? grid.max_halo / num_border_rows : 1;
+    bool const tuned = temporal_block == 0;
+    if (tuned)
+        temporal_block = tune_temporal_blocking(&grid, &kernel, num_border_rows, min(max_block, options->iterations));
+    temporal_block = max(1, min(temporal_block, max_block));
+    int const halo_rows = temporal_block * num_border_rows;
+    block_grid_set_halo(&grid, halo_rows);
+    if (world_rank == 0) {
+        printf("Decomposition: %d x %d blocks of up to %u x %u pixels\n", grid.dims[1], grid.dims[0],
+                (image->width + grid.dims[1] - 1) / grid.dims[1], (image->height + grid.dims[0] - 1) / grid.dims[0]);
+        printf("Temporal blocking: %u iterations per halo exchange of %d rows%s\n",
+                temporal_block, halo_rows, tuned ? " (tuned)" : "");
     }
 
+    // Make space for this rank's block and halo_rows rows and columns of halo on every side.
+    // There is no special case for the edges of the picture, there the halo stays zero,
+    // which is the zero padding of the whole image.
+    unsigned int const b = num_border_rows, D = halo_rows, W = grid.width, H = grid.height;
+    my_image = newImage(W + 2 * D, H + 2 * D);
+    image_t *processImage = newImage(my_image->width, my_image->height);
+    memset(my_image->rawdata, 0, sizeof(pixel) * my_image->width * my_image->height);
+    memset(processImage->rawdata, 0, sizeof(pixel) * my_image->width * my_image->height);
 
-    int num_border_rows = (kernelDims[options->kernelIndex] - 1 ) / 2;
-    int my_image_height = rows_to_receive[world_rank];
-
-    // TODO: Make space for halo-exchange
-    // ------------------------------------------------------------
-    // This should include space for the rows that are to be exchanged both
-    // at the top and at the bottom of each respective slice.
-    //int extra_rows = world_rank != 0 && world_rank != world_sz-1 ? num_border_rows*2 : num_border_rows;
-
-    // Make space for original image and the number of rows on each end. *2 to account for both under and over the image.
-    // There is no special case for the edges of the picture, just to ease readability and further work with the code. Leading to a small increase in memory allocation...
-    my_image = newImage(image->width, my_image_height + num_border_rows*2);
-
-
-
-    // Ternary operator
-    // Every rank other than 0 are not senders and thus
-    // do not need to actually have anything in the send buffer. These 
-    // get their send buffer pointer set to NULL.
-    pixel *image_send_buffer = world_rank == 0 ? image->rawdata : NULL;
-
-    ///////////////////////////////////////////////////////////////////////////
-    // TODO: Update the recv buffer pointer.                                 //
-    //-----------------------------------------------------------------------//
-    // Should point to the start of where this rank's slice of the image     //
-    // starts. The topmost and bottom-most rows should not be written by the //
-    // scatter operation                                                     //
-    ///////////////////////////////////////////////////////////////////////////
-
-    // Pointing pointer at the first pixel offset by the amount of rows to be exchanged
-    pixel *my_image_slice = my_image->rawdata+(image->width*num_border_rows);
-
-    MPI_Scatterv(image_send_buffer,        // Send Buffer
-            bytes_to_transfer,             // Send Counts
-            displacements,                 // Displacements
-            MPI_BYTE,                      // Send Type
-            my_image_slice,                // Recv Buffer
-            bytes_to_transfer[world_rank], // Recv Count
-            MPI_BYTE,                      // Recv Type
-            0,                             // Root
-            MPI_COMM_WORLD);               // Communicator
+    // Straight into the block, the halos are not written by the scatter
+    if (raw_input) {
+        double const readtime = MPI_Wtime();
+        raw_image_read_blocks(&grid, options->input, my_image);
+        if (world_rank == 0)
+            printf("Parallel read: %.3f seconds\n", MPI_Wtime() - readtime);
+    } else {
+        block_grid_scatter(&grid, image, my_image, 0);
+    }
 
     ///////////////////////////////////////////////////
     // TODO: implement time measurement from here    //
@@ -209,79 +1177,62 @@ int main(int argc, char **argv) {
     // image->data is a 2-dimensional array of pixel which is accessed row
     // first ([y][x]) each pixel is a struct of 4 unsigned char for the red,
     // blue and green colour channel
-    image_t *processImage = newImage(image->width, my_image->height);
-
-    size_t bytes_to_exchange = num_border_rows * sizeof(pixel) * my_image->width;
+    bool const up = grid.neighbour[0] != MPI_PROC_NULL, down = grid.neighbour[1] != MPI_PROC_NULL;
+    bool const left = grid.neighbour[2] != MPI_PROC_NULL, right = grid.neighbour[3] != MPI_PROC_NULL;
 
-    // Wrapper methods for send and receive
+    // The part of the first step of a block that needs no halo, empty if the block is thinner than 2 b
+    unsigned int const iy0 = D + b, iy1 = max(iy0, D + H - min(b, H));
+    unsigned int const ix0 = D + b, ix1 = max(ix0, D + W - min(b, W));
 
-    void send_and_get_top(){
-        // I tried experimenting with both sendrecv and send / recv individually. I couldn't notice any difference in speed between the two,
-        // so I chose to go for the more compact single sendrecv.
-        MPI_Sendrecv(
-            my_image->rawdata+(image->width), bytes_to_exchange, MPI_BYTE, world_rank-1, world_rank,
-            my_image->rawdata, bytes_to_exchange, MPI_BYTE, world_rank-1, MPI_ANY_TAG, MPI_COMM_WORLD, MPI_STATUS_IGNORE
-        );
-    }
+    for (unsigned int i = 0; i < options->iterations; i += temporal_block) {
+        unsigned int const steps = min(temporal_block, options->iterations - i);
 
-    void send_and_get_bottom(){
-        MPI_Sendrecv(
-            my_image->rawdata+(image->width*my_image_height), bytes_to_exchange, MPI_BYTE, world_rank+1, world_rank,
-            my_image->rawdata+(image->width*(my_image_height+1)), bytes_to_exchange, MPI_BYTE, world_rank+1, MPI_ANY_TAG, MPI_COMM_WORLD, MPI_STATUS_IGNORE
-        );
-    }
-
-    for (unsigned int i = 0; i < options->iterations; i ++) {
         ///////////////////////////
         // TODO: BORDER EXCHANGE //
         ///////////////////////////
-        if(world_rank == 0){
-            if(world_sz > 1)
-                send_and_get_bottom();
-        } else if(world_rank == world_sz-1){
-            send_and_get_top();
-        } else{
-            if(world_rank % 2 == 0){
-                send_and_get_top();
-                send_and_get_bottom();
-            } else{
-                send_and_get_bottom();
-                send_and_get_top();
-            }
-        }
+        // The block is rows and columns D to D+H-1 and D to D+W-1 of the
+        // buffer. Its outer D rows and columns go to the up to eight
+        // neighbours while the part of the first step that needs no halo is
+        // convolved.
+        MPI_Request requests[2 * GRID_NEIGHBOURS];
+        block_grid_exchange(&grid, my_image, requests);
 
         // Apply Kernel
-        applyKernel(processImage->data,
-                my_image->data,
-                my_image->width,
-                my_image->height,
-                kernels[options->kernelIndex],
-                kernelDims[options->kernelIndex],
-                kernelFactors[options->kernelIndex]
-                );
+        applyConvKernelRect(processImage->data, my_image->data, my_image->width, my_image->height,
+                &kernel, ix0, ix1, iy0, iy1);
 
-        swapImage(&processImage, &my_image);
+        MPI_Waitall(2 * GRID_NEIGHBOURS, requests, MPI_STATUSES_IGNORE);
 
-        // Wait until all ranks have done their part before resuming
-        MPI_Barrier(MPI_COMM_WORLD);
+        for (unsigned int t = 0; t < steps; t++) {
+            // Pixels still valid after this step, the block itself after the last of a full block
+            unsigned int const y0 = up ? (t + 1) * b : D, y1 = down ? H + 2 * D - (t + 1) * b : D + H;
+            unsigned int const x0 = left ? (t + 1) * b : D, x1 = right ? W + 2 * D - (t + 1) * b : D + W;
+
+            if (t == 0) {
+                // The frame around what was done while the halos were in flight
+                applyConvKernelRect(processImage->data, my_image->data, my_image->width, my_image->height,
+                        &kernel, x0, x1, y0, min(iy0, y1));
+                applyConvKernelRect(processImage->data, my_image->data, my_image->width, my_image->height,
+                        &kernel, x0, x1, iy1, y1);
+                applyConvKernelRect(processImage->data, my_image->data, my_image->width, my_image->height,
+                        &kernel, x0, min(ix0, x1), iy0, iy1);
+                applyConvKernelRect(processImage->data, my_image->data, my_image->width, my_image->height,
+                        &kernel, ix1, x1, iy0, iy1);
+            } else {
+                applyConvKernelRect(processImage->data, my_image->data, my_image->width, my_image->height,
+                        &kernel, x0, x1, y0, y1);
+            }
+
+            // No barrier, the halos of the next exchange are what orders the ranks
+            swapImage(&processImage, &my_image);
+        }
     }
 
     freeImage(processImage);
-    /////////////////////////////////////////////////////////////////////
-    // TODO: Update the "Send Buffer" pointer such that it points      //
-    // to the starting location in each respective slice.              //
-    /////////////////////////////////////////////////////////////////////
-
-    // Pointing pointer at the first pixel offset by the amount of rows to be exchanged
-    MPI_Gatherv(my_image->rawdata+(image->width*num_border_rows),         // Send Buffer
-            bytes_to_transfer[world_rank], // Send Count
-            MPI_BYTE,                      // Send Type
-            image->rawdata,                // Recv Buffer
-            bytes_to_transfer,             // Recv Counts
-            displacements,                 // Recv Displacements
-            MPI_BYTE,                      // Recv Type
-            0,                             // Root
-            MPI_COMM_WORLD);               // Communicator
+    conv_kernel_free(&kernel);
+
+    if (!raw_output)
+        block_grid_gather(&grid, image, my_image, 0);
 
 
     //////////////////////////////////////////////
@@ -291,10 +1242,16 @@ int main(int argc, char **argv) {
     if(world_rank == 0){
         endtime = MPI_Wtime();
         printf("Time spent: %.3f seconds\n", endtime-starttime);
+        printf("Throughput: %.1f MP/s\n", 1e-6 * image->width * image->height * options->iterations / (endtime-starttime));
     }
 
 
-    if ( world_rank == 0) {
+    if (raw_output) {
+        double const writetime = MPI_Wtime();
+        raw_image_write_blocks(&grid, options->output, my_image);
+        if (world_rank == 0)
+            printf("Parallel write: %.3f seconds\n", MPI_Wtime() - writetime);
+    } else if ( world_rank == 0) {
         //Write the image back to disk
         if (saveImage(image, options->output) < 1) {
             fprintf(stderr, "Could not save output to '%s'!\n", options->output);
@@ -302,6 +1259,8 @@ int main(int argc, char **argv) {
             abort();
         };
     }
+    freeImage(my_image);
+    block_grid_free(&grid);
 
     MPI_Finalize();
 
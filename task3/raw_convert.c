@@ -0,0 +1,89 @@
+/*
+ * Converts images between the format of loadImage / saveImage (bmp) and
+ * the raw format of raw_image.h, which main reads and writes with MPI-IO.
+ *
+ *   ./raw_convert image.bmp image.raw
+ *   ./raw_convert image.raw image.bmp
+ *
+ * The direction follows the names, a name ending in .raw is the raw side.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <image_utils.h>
+
+#include "raw_image.h"
+
+
+const char *usage =
+"raw_convert <in> <out>\n"
+"\tExactly one of <in> and <out> ends in .raw\n";
+
+
+// A raw image into memory
+image_t *read_raw(char const *name)
+{
+    FILE *in = fopen(name, "rb");
+    if (in == NULL) {
+        perror(name);
+        return NULL;
+    }
+    raw_image_header header;
+    image_t *image = NULL;
+    if (fread(&header, sizeof(header), 1, in) == 1 && raw_image_header_valid(&header)) {
+        image = newImage(header.width, header.height);
+        if (fread(image->rawdata, sizeof(pixel), (size_t)header.width * header.height, in)
+                != (size_t)header.width * header.height) {
+            freeImage(image);
+            image = NULL;
+        }
+    }
+    fclose(in);
+    if (image == NULL)
+        fprintf(stderr, "%s: not a raw image\n", name);
+    return image;
+}
+
+int write_raw(image_t const *image, char const *name)
+{
+    FILE *out = fopen(name, "wb");
+    if (out == NULL) {
+        perror(name);
+        return -1;
+    }
+    raw_image_header header;
+    raw_image_header_init(&header, image->width, image->height);
+    int err = fwrite(&header, sizeof(header), 1, out) != 1
+        || fwrite(image->rawdata, sizeof(pixel), (size_t)image->width * image->height, out)
+            != (size_t)image->width * image->height;
+    if (fclose(out) != 0 || err) {
+        fprintf(stderr, "%s: write failed\n", name);
+        return -1;
+    }
+    return 0;
+}
+
+
+int main ( int argc, char **argv )
+{
+    if (argc != 3 || raw_image_name(argv[1]) == raw_image_name(argv[2])) {
+        fprintf ( stderr, "%s", usage );
+        exit ( EXIT_FAILURE );
+    }
+    const char *in_path = argv[1], *out_path = argv[2];
+    bool const to_raw = raw_image_name(out_path);
+
+    image_t *image = to_raw ? loadImage(in_path) : read_raw(in_path);
+    if (image == NULL) {
+        fprintf ( stderr, "Could not load image '%s'!\n", in_path );
+        exit ( EXIT_FAILURE );
+    }
+
+    if (to_raw ? write_raw(image, out_path) != 0 : saveImage(image, out_path) < 1) {
+        fprintf ( stderr, "Could not save output to '%s'!\n", out_path );
+        exit ( EXIT_FAILURE );
+    }
+
+    printf("%s -> %s: %u x %u pixels\n", in_path, out_path, image->width, image->height);
+    freeImage(image);
+    return 0;
+}
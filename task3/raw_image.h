@@ -0,0 +1,44 @@
+#ifndef RAW_IMAGE_H
+#define RAW_IMAGE_H
+
+/*
+ * Uncompressed images that ranks read and write in parallel with MPI-IO.
+ *
+ * A raw image is a raw_image_header followed by height rows of width
+ * pixels, top row first, each pixel in the memory layout of `pixel` and the
+ * header in native byte order. Row-major pixels make any block of the image
+ * an MPI subarray of the file, so every rank of any block grid reads and
+ * writes its own block directly and no rank ever holds the whole image.
+ * raw_convert.c converts to and from the formats of loadImage and saveImage.
+ */
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#define RAW_IMAGE_MAGIC "T3RAWIMG"
+
+typedef struct {
+    char magic[8];              // RAW_IMAGE_MAGIC, not terminated
+    uint32_t width, height;
+} raw_image_header;
+
+// Images are raw if and only if their name ends in .raw
+static inline bool raw_image_name(char const *name)
+{
+    size_t n = name ? strlen(name) : 0;
+    return n >= 4 && strcmp(name + n - 4, ".raw") == 0;
+}
+
+static inline void raw_image_header_init(raw_image_header *h, uint32_t width, uint32_t height)
+{
+    memcpy(h->magic, RAW_IMAGE_MAGIC, sizeof(h->magic));
+    h->width = width;
+    h->height = height;
+}
+
+static inline bool raw_image_header_valid(raw_image_header const *h)
+{
+    return memcmp(h->magic, RAW_IMAGE_MAGIC, sizeof(h->magic)) == 0 && h->width > 0 && h->height > 0;
+}
+
+#endif
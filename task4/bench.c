@@ -0,0 +1,481 @@
+/*
+ * Microbenchmarks for genann.
+ *
+ * Build with the allocator wrapped, so every malloc/calloc made from
+ * genann.c is counted:
+ *
+ *   gcc -O3 -march=native genann.c bench.c -o bench -lopenblas -lm \
+ *       -Wl,--wrap=malloc,--wrap=calloc
+ *
+ * Only calls from the objects linked here are wrapped, allocations inside
+ * the shared BLAS library are not counted. Add -fopenmp for -t, and set
+ * OPENBLAS_NUM_THREADS=1 so the BLAS does not start threads of its own.
+ * Add -DGENANN_PROFILE for the per-layer profile written by -p.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <getopt.h>
+#include <math.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include "genann.h"
+#include "genann_ext.h"
+
+#define min(x,y) (((x) < (y)) ? (x) : (y))
+#define max(x,y) (((x) > (y)) ? (x) : (y))
+
+
+void options ( int argc, char **argv );
+
+const char *usage =
+"\t-i <int>\t(inputs)\n"
+"\t-l <int>\t(hidden layers)\n"
+"\t-H <int>\t(neurons per hidden layer)\n"
+"\t-o <int>\t(outputs)\n"
+"\t-s <int>\t(samples per timed pass)\n"
+"\t-r <int>\t(timed passes, the median is reported)\n"
+"\t-b <int>\t(mini-batch size for the batched cases)\n"
+"\t-t <int>\t(threads for the batched inference and parallel training cases, needs -fopenmp)\n"
+"\t-L <dir>\t(time loading the network from model files written to dir instead)\n"
+"\t-w <int,...>\t(hidden layer widths for the layered network cases, the same as the network otherwise)\n"
+"\t-p <file>\t(write the per-layer profile of the cases to file as JSON, build genann.c with -DGENANN_PROFILE)\n";
+
+
+//Global variables and definitions
+int inputs = 64, hidden_layers = 3, hidden = 256, outputs = 10;
+int samples = 10000;
+int repeats = 5;
+int batch_size = 32;
+int num_threads = 1;
+const char *load_dir = NULL;
+const char *profile_path = NULL;
+int net_hidden[64], net_hidden_layers = -1;     // From -w
+double learning_rate = 0.01;
+
+double *sample_in, *sample_out;
+double *batch_out, *batch_work;     // Per thread slices, allocated once
+size_t work_size;
+float *sample_in_f32;
+genann_f32 *ann_f32;
+genann_i8 *ann_i8;
+genann_net *net;
+
+
+//--------------------------------------------------------------------------
+//------------------------allocation counting-------------------------------
+//--------------------------------------------------------------------------
+// Weak, so the binary still links without --wrap, the wrappers are never called then
+void *__real_malloc(size_t size) __attribute__((weak));
+void *__real_calloc(size_t nmemb, size_t size) __attribute__((weak));
+
+// volatile: the compiler assumes malloc leaves other globals alone
+volatile long allocations = 0;
+
+void *__wrap_malloc(size_t size)
+{
+    allocations++;
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t nmemb, size_t size)
+{
+    allocations++;
+    return __real_calloc(nmemb, size);
+}
+
+// False when the binary was linked without --wrap, the counts are meaningless then
+static bool counting_allocations(void)
+{
+    long before = allocations;
+    void * volatile probe = malloc(1);     // Or the pair is optimised away
+    free(probe);
+    return allocations != before;
+}
+
+
+//--------------------------------------------------------------------------
+//------------------------benchmark harness---------------------------------
+//--------------------------------------------------------------------------
+static double monotonic_seconds(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (double)t.tv_sec + 1e-9 * (double)t.tv_nsec;
+}
+
+static int compare_doubles(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+typedef struct {
+    const char *name;
+    void (*pass)(genann *ann);      // One pass over all samples
+} bench_case;
+
+typedef struct {
+    double median;          // Seconds per pass
+    double allocs;          // Heap allocations per sample
+} bench_result;
+
+static bench_result bench_case_run(bench_case const *c, genann *ann)
+{
+    bench_result res;
+    double *times = malloc(sizeof(double) * repeats);
+
+    c->pass(ann);       // Warm-up
+    long before = allocations;
+    for (int r = 0; r < repeats; r++) {
+        double start = monotonic_seconds();
+        c->pass(ann);
+        times[r] = monotonic_seconds() - start;
+    }
+    res.allocs = (double)(allocations - before) / ((double)repeats * samples);
+
+    qsort(times, repeats, sizeof(double), compare_doubles);
+    res.median = (repeats % 2) ? times[repeats / 2] : 0.5 * (times[repeats / 2 - 1] + times[repeats / 2]);
+    free(times);
+    return res;
+}
+
+static void report(bench_case const *c, bench_result const *res, bool counted)
+{
+    printf("%-12s\tMedian:\t%e s\tSamples/s: %.0f\tus/sample: %.3f",
+            c->name, res->median, samples / res->median, 1e6 * res->median / samples);
+    if (counted)
+        printf("\tAllocs/sample: %.3f", res->allocs);
+    printf("\n");
+}
+
+
+//--------------------------------------------------------------------------
+//------------------------benchmark cases-----------------------------------
+//--------------------------------------------------------------------------
+void pass_run(genann *ann)
+{
+    for (int s = 0; s < samples; s++)
+        genann_run(ann, &sample_in[(size_t)s * inputs]);
+}
+
+void pass_train(genann *ann)
+{
+    for (int s = 0; s < samples; s++)
+        genann_train(ann, &sample_in[(size_t)s * inputs], &sample_out[(size_t)s * outputs], learning_rate);
+}
+
+void pass_train_batch(genann *ann)
+{
+    for (int s = 0; s < samples; s += batch_size)
+        genann_train_batch(ann, &sample_in[(size_t)s * inputs], &sample_out[(size_t)s * outputs],
+                min(batch_size, samples - s), learning_rate);
+}
+
+void pass_train_parallel(genann *ann)
+{
+    genann_train_parallel(ann, sample_in, sample_out, samples, batch_size, learning_rate, num_threads, 0);
+}
+
+void pass_train_hogwild(genann *ann)
+{
+    genann_train_parallel(ann, sample_in, sample_out, samples, batch_size, learning_rate, num_threads, 1);
+}
+
+// Batches are independent, each thread scores its own with its own workspace
+void pass_run_batch(genann *ann)
+{
+    #pragma omp parallel for schedule(dynamic) num_threads(num_threads)
+    for (int s = 0; s < samples; s += batch_size) {
+        int t = 0;
+#ifdef _OPENMP
+        t = omp_get_thread_num();
+#endif
+        genann_run_batch(ann, &sample_in[(size_t)s * inputs], min(batch_size, samples - s),
+                &batch_out[(size_t)t * batch_size * outputs], &batch_work[t * work_size]);
+    }
+}
+
+void pass_run_net(genann *ann)
+{
+    for (int s = 0; s < samples; s++)
+        genann_net_run(net, &sample_in[(size_t)s * inputs]);
+}
+
+void pass_train_net(genann *ann)
+{
+    for (int s = 0; s < samples; s++)
+        genann_net_train(net, &sample_in[(size_t)s * inputs], &sample_out[(size_t)s * outputs], learning_rate);
+}
+
+void pass_run_f32(genann *ann)
+{
+    for (int s = 0; s < samples; s++)
+        genann_run_f32(ann_f32, &sample_in_f32[(size_t)s * inputs]);
+}
+
+void pass_run_i8(genann *ann)
+{
+    for (int s = 0; s < samples; s++)
+        genann_run_i8(ann_i8, &sample_in_f32[(size_t)s * inputs]);
+}
+
+// Max |difference| of the reduced precision outputs from genann_run over all samples
+static double precision_loss(float const *(*run)(void const *net, float const *in), void const *net, genann *ann)
+{
+    double max_diff = 0.0;
+    for (int s = 0; s < samples; s++) {
+        double const *o = genann_run(ann, &sample_in[(size_t)s * inputs]);
+        float const *lp = run(net, &sample_in_f32[(size_t)s * inputs]);
+        for (int j = 0; j < outputs; j++)
+            max_diff = fmax(max_diff, fabs(o[j] - lp[j]));
+    }
+    return max_diff;
+}
+
+static float const *run_f32(void const *net, float const *in) { return genann_run_f32(net, in); }
+static float const *run_i8(void const *net, float const *in) { return genann_run_i8(net, in); }
+
+//--------------------------------------------------------------------------
+//------------------------model loading-------------------------------------
+//--------------------------------------------------------------------------
+typedef enum { LOAD_TEXT, LOAD_BINARY, LOAD_MAP, LOAD_MAP_VERIFY } load_kind;
+
+static genann *load(load_kind kind, const char *path)
+{
+    genann *ann = NULL;
+    FILE *f;
+    switch (kind) {
+        case LOAD_TEXT:
+        case LOAD_BINARY:
+            if ((f = fopen(path, "rb")) == NULL)
+                return NULL;
+            ann = kind == LOAD_TEXT ? genann_read(f) : genann_read_binary(f);
+            fclose(f);
+            break;
+        case LOAD_MAP:        ann = genann_map(path, 0); break;
+        case LOAD_MAP_VERIFY: ann = genann_map(path, 1); break;
+    }
+    return ann;
+}
+
+static long file_size(const char *path)
+{
+    FILE *f = fopen(path, "rb");
+    if (f == NULL)
+        return -1;
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    fclose(f);
+    return size;
+}
+
+// Time from opening the file to the first output, so lazily mapped pages are paid for
+static void bench_load(genann *ann)
+{
+    char text_path[4096], bin_path[4096];
+    snprintf(text_path, sizeof(text_path), "%s/bench_model.txt", load_dir);
+    snprintf(bin_path, sizeof(bin_path), "%s/bench_model.bin", load_dir);
+
+    FILE *f = fopen(text_path, "w");
+    if (f == NULL) { perror(text_path); exit ( EXIT_FAILURE ); }
+    genann_write(ann, f);
+    fclose(f);
+    f = fopen(bin_path, "wb");
+    if (f == NULL || genann_write_binary(ann, f) != 0) { perror(bin_path); exit ( EXIT_FAILURE ); }
+    fclose(f);
+
+    static const struct { const char *name; load_kind kind; bool binary; } loads[] = {
+        { "Text read",   LOAD_TEXT,       false },
+        { "Binary read", LOAD_BINARY,     true },
+        { "Map",         LOAD_MAP,        true },
+        { "Map verify",  LOAD_MAP_VERIFY, true },
+    };
+    printf("Text model: %ld bytes\tBinary model: %ld bytes\n", file_size(text_path), file_size(bin_path));
+
+    double *times = malloc(sizeof(double) * repeats);
+    for (size_t l = 0; l < sizeof(loads) / sizeof(loads[0]); l++) {
+        const char *path = loads[l].binary ? bin_path : text_path;
+        double max_diff = 0.0;
+        for (int r = 0; r < repeats; r++) {
+            double start = monotonic_seconds();
+            genann *loaded = load(loads[l].kind, path);
+            if (loaded == NULL) {
+                fprintf ( stderr, "%s failed\n", loads[l].name );
+                exit ( EXIT_FAILURE );
+            }
+            double const *o = genann_run(loaded, sample_in);
+            times[r] = monotonic_seconds() - start;
+
+            double const *ref = genann_run(ann, sample_in);
+            for (int j = 0; j < outputs; j++)
+                max_diff = fmax(max_diff, fabs(o[j] - ref[j]));
+            if (loads[l].kind >= LOAD_MAP)
+                genann_unmap(loaded);
+            else
+                genann_free(loaded);
+        }
+        qsort(times, repeats, sizeof(double), compare_doubles);
+        printf("%-12s\tMedian:\t%e s\tMB/s: %.0f\tmax |diff|: %.1e\n", loads[l].name, times[repeats / 2],
+                1e-6 * file_size(path) / times[repeats / 2], max_diff);
+    }
+    free(times);
+    remove(text_path);
+    remove(bin_path);
+}
+
+
+bench_case cases[] = {
+    { "Run",         pass_run },
+    { "Train",       pass_train },
+    { "Train batch", pass_train_batch },
+    { "Train par",   pass_train_parallel },
+    { "Train hogwd", pass_train_hogwild },
+    { "Run batch",   pass_run_batch },
+    { "Run f32",     pass_run_f32 },
+    { "Run int8",    pass_run_i8 },
+    { "Run net",     pass_run_net },
+    { "Train net",   pass_train_net },
+};
+
+
+int main ( int argc, char **argv )
+{
+    options ( argc, argv );
+    srand ( 1 );
+
+    sample_in = malloc(sizeof(double) * samples * inputs);
+    sample_out = malloc(sizeof(double) * samples * outputs);
+    for (long i = 0; i < (long)samples * inputs; i++)
+        sample_in[i] = (double)rand() / RAND_MAX;
+    for (long i = 0; i < (long)samples * outputs; i++)
+        sample_out[i] = (double)(rand() % 2);
+
+    genann *ann = genann_init(inputs, hidden_layers, hidden, outputs);
+    if (ann == NULL) {
+        fprintf ( stderr, "genann_init failed\n" );
+        exit ( EXIT_FAILURE );
+    }
+
+    work_size = genann_run_batch_work_size(ann, batch_size);
+    batch_out = malloc(sizeof(double) * num_threads * batch_size * outputs);
+    batch_work = malloc(sizeof(double) * (num_threads * work_size + 1));
+
+    // Batched inference has to agree with genann_run
+    double max_diff = 0.0;
+    int rows = min(batch_size, samples);
+    genann_run_batch(ann, sample_in, rows, batch_out, batch_work);
+    for (int s = 0; s < rows; s++) {
+        double const *o = genann_run(ann, &sample_in[(size_t)s * inputs]);
+        for (int j = 0; j < outputs; j++)
+            max_diff = fmax(max_diff, fabs(o[j] - batch_out[s * outputs + j]));
+    }
+
+    // Reduced precision copies, checked before any case trains the network
+    sample_in_f32 = malloc(sizeof(float) * samples * inputs);
+    for (long i = 0; i < (long)samples * inputs; i++)
+        sample_in_f32[i] = (float)sample_in[i];
+    ann_f32 = genann_to_f32(ann);
+    ann_i8 = genann_to_i8(ann);
+    double loss_f32 = precision_loss(run_f32, ann_f32, ann);
+    double loss_i8 = precision_loss(run_i8, ann_i8, ann);
+
+    // The layered network, a copy of ann unless -w gives other widths
+    double net_diff = -1.0;
+    if (net_hidden_layers < 0) {
+        net = genann_net_from(ann);
+        net_diff = 0.0;
+        for (int s = 0; s < rows; s++) {
+            double const *o = genann_run(ann, &sample_in[(size_t)s * inputs]);
+            double const *no = genann_net_run(net, &sample_in[(size_t)s * inputs]);
+            for (int j = 0; j < outputs; j++)
+                net_diff = fmax(net_diff, fabs(o[j] - no[j]));
+        }
+    } else {
+        int widths[66];
+        widths[0] = inputs;
+        for (int l = 0; l < net_hidden_layers; l++)
+            widths[l + 1] = net_hidden[l];
+        widths[net_hidden_layers + 1] = outputs;
+        net = genann_net_init(net_hidden_layers + 1, widths, NULL);
+    }
+
+    bool counted = counting_allocations();
+    printf("inputs=%d hidden_layers=%d hidden=%d outputs=%d weights=%d samples=%d batch=%d threads=%d (%d timed passes)\n",
+            inputs, hidden_layers, hidden, outputs, ann->total_weights, samples, batch_size, num_threads, repeats);
+    printf("Run batch max |diff| against genann_run: %.1e\n", max_diff);
+    printf("Run f32 max |diff| against genann_run: %.1e\n", loss_f32);
+    printf("Run int8 max |diff| against genann_run: %.1e\n", loss_i8);
+    if (net_diff >= 0.0)
+        printf("Run net max |diff| against genann_run: %.1e\n", net_diff);
+    else {
+        printf("Layered network: %d", inputs);
+        for (int l = 0; l < net_hidden_layers; l++)
+            printf("-%d", net_hidden[l]);
+        printf("-%d, weights=%d\n", outputs, net->total_weights);
+    }
+    if (!counted)
+        printf("Allocations not counted, link with -Wl,--wrap=malloc,--wrap=calloc\n");
+
+    genann_profile_reset();
+    if (load_dir != NULL)
+        bench_load(ann);
+    else for (size_t c = 0; c < sizeof(cases) / sizeof(cases[0]); c++) {
+        bench_result res = bench_case_run(&cases[c], ann);
+        report(&cases[c], &res, counted);
+    }
+
+    if (profile_path != NULL) {
+        FILE *f = fopen(profile_path, "w");
+        if (f == NULL) {
+            perror(profile_path);
+            exit ( EXIT_FAILURE );
+        }
+        genann_profile_dump(f);
+        fclose(f);
+    }
+
+    genann_free(ann);
+    free(batch_out);
+    free(batch_work);
+    genann_free_f32(ann_f32);
+    genann_free_i8(ann_i8);
+    genann_net_free(net);
+    free(sample_in_f32);
+    free(sample_in);
+    free(sample_out);
+    return 0;
+}
+
+
+void options ( int argc, char **argv )
+{
+    int o;
+    while ( (o = getopt(argc,argv,"i:l:H:o:s:r:b:t:L:p:w:h")) != -1 )
+    switch ( o )
+    {
+        case 'i': inputs = max ( 1, strtol ( optarg, NULL, 10 ) ); break;
+        case 'l': hidden_layers = max ( 0, strtol ( optarg, NULL, 10 ) ); break;
+        case 'H': hidden = max ( 1, strtol ( optarg, NULL, 10 ) ); break;
+        case 'o': outputs = max ( 1, strtol ( optarg, NULL, 10 ) ); break;
+        case 's': samples = max ( 1, strtol ( optarg, NULL, 10 ) ); break;
+        case 'r': repeats = max ( 1, strtol ( optarg, NULL, 10 ) ); break;
+        case 'b': batch_size = max ( 1, strtol ( optarg, NULL, 10 ) ); break;
+        case 't': num_threads = max ( 1, strtol ( optarg, NULL, 10 ) ); break;
+        case 'L': load_dir = optarg; break;
+        case 'p': profile_path = optarg; break;
+        case 'w':
+            net_hidden_layers = 0;
+            for (char *p = strtok ( optarg, "," ); p != NULL && net_hidden_layers < 64; p = strtok ( NULL, "," ))
+                net_hidden[net_hidden_layers++] = max ( 1, strtol ( p, NULL, 10 ) );
+            break;
+        case 'h':
+            fprintf ( stderr, "%s", usage );
+            exit ( EXIT_FAILURE );
+            break;
+    }
+}
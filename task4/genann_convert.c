@@ -0,0 +1,87 @@
+/*
+ * Converts genann models between the text format of genann_write and the
+ * binary format of genann_write_binary.
+ *
+ *   gcc -O3 -march=native genann.c genann_convert.c -o genann_convert -lopenblas -lm
+ *   ./genann_convert model.txt model.bin
+ *   ./genann_convert -t model.bin model.txt
+ *
+ * The text format does not record activations, a text model is written
+ * with the defaults and a binary one is read with whatever it names.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <getopt.h>
+
+#include "genann.h"
+#include "genann_ext.h"
+
+
+void options ( int argc, char **argv );
+
+const char *usage =
+"genann_convert [-t] <in> <out>\n"
+"\t-t\t(binary to text, the default is text to binary)\n";
+
+
+//Global variables and definitions
+int to_text = 0;
+
+
+int main ( int argc, char **argv )
+{
+    options ( argc, argv );
+    if (argc - optind != 2) {
+        fprintf ( stderr, "%s", usage );
+        exit ( EXIT_FAILURE );
+    }
+    const char *in_path = argv[optind], *out_path = argv[optind + 1];
+
+    FILE *in = fopen(in_path, to_text ? "rb" : "r");
+    if (in == NULL) {
+        perror(in_path);
+        exit ( EXIT_FAILURE );
+    }
+    genann *ann = to_text ? genann_read_binary(in) : genann_read(in);
+    fclose(in);
+    if (ann == NULL) {
+        fprintf ( stderr, "%s: could not read model\n", in_path );
+        exit ( EXIT_FAILURE );
+    }
+
+    FILE *out = fopen(out_path, to_text ? "w" : "wb");
+    if (out == NULL) {
+        perror(out_path);
+        exit ( EXIT_FAILURE );
+    }
+    int err = 0;
+    if (to_text)
+        genann_write(ann, out);
+    else
+        err = genann_write_binary(ann, out);
+    if (fclose(out) != 0 || err) {
+        fprintf ( stderr, "%s: write failed\n", out_path );
+        exit ( EXIT_FAILURE );
+    }
+
+    printf("%s -> %s: inputs=%d hidden_layers=%d hidden=%d outputs=%d weights=%d\n",
+            in_path, out_path, ann->inputs, ann->hidden_layers, ann->hidden, ann->outputs, ann->total_weights);
+    genann_free(ann);
+    return 0;
+}
+
+
+void options ( int argc, char **argv )
+{
+    int o;
+    while ( (o = getopt(argc,argv,"th")) != -1 )
+    switch ( o )
+    {
+        case 't': to_text = 1; break;
+        case 'h':
+        default:
+            fprintf ( stderr, "%s", usage );
+            exit ( EXIT_FAILURE );
+            break;
+    }
+}
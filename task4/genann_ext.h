@@ -0,0 +1,153 @@
+/*
+ * Additions to the genann API. Kept out of genann.h, so that header
+ * stays as shipped and the functions here only rely on struct genann.
+ */
+#ifndef GENANN_EXT_H
+#define GENANN_EXT_H
+
+#include <stdint.h>
+
+#include "genann.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* More per-neuron activations for activation_hidden/activation_output. */
+double genann_act_tanh(const genann *ann, double a);
+double genann_act_relu(const genann *ann, double a);
+
+/* Whole-layer activations, in place on n values. genann_run and
+ * genann_train use these for the per-neuron activations they match. */
+typedef void (*genann_actfun_vec)(double *v, int n);
+void genann_act_sigmoid_vec(double *v, int n);
+void genann_act_tanh_vec(double *v, int n);
+void genann_act_relu_vec(double *v, int n);
+void genann_act_threshold_vec(double *v, int n);
+void genann_act_linear_vec(double *v, int n);
+
+/* Doubles of work genann_batch_gradient needs for a batch. */
+size_t genann_batch_work_size(genann const *ann, int batch);
+
+/* Runs a batch forward and backward, then sets
+ * target = beta * target + alpha * (sum over the batch of delta * input),
+ * where target has the layout of the weights: the weights themselves to
+ * train, or a gradient buffer. For trainers that combine gradients. */
+void genann_batch_gradient(genann const *ann, double const *inputs, double const *desired_outputs,
+        int batch, double *work, double *target, double alpha, double beta);
+
+/* Trains on batch_size samples at once, inputs and desired_outputs are
+ * row-major batch_size x inputs and batch_size x outputs. The weights move
+ * by learning_rate times the mean gradient of the batch, so a batch of one
+ * is the same step as genann_train. */
+void genann_train_batch(genann const *ann, double const *inputs, double const *desired_outputs,
+        int batch_size, double learning_rate);
+
+/* One epoch over `samples` samples on `threads` threads (OpenMP), each with
+ * its own outputs and deltas. By default every mini-batch of batch_size is
+ * split over the threads and their gradients are summed with a tree
+ * reduction, the step is then the same as genann_train_batch. With hogwild
+ * set, threads instead train their shard sample by sample straight into the
+ * shared weights without locks, and batch_size is ignored. */
+void genann_train_parallel(genann const *ann, double const *inputs, double const *desired_outputs,
+        int samples, int batch_size, double learning_rate, int threads, int hogwild);
+
+/* Doubles of workspace genann_run_batch needs for `rows` inputs. */
+size_t genann_run_batch_work_size(genann const *ann, int rows);
+
+/* Runs `rows` inputs at once, inputs is row-major rows x inputs and outputs
+ * rows x outputs. Intermediate layers go to work (genann_run_batch_work_size
+ * doubles, or NULL to allocate it per call), ann is only read, so threads can
+ * share one network as long as each passes its own work and outputs. */
+void genann_run_batch(genann const *ann, double const *inputs, int rows, double *outputs, double *work);
+
+/* A network whose layers each have their own width and activation.
+ * layer[0] is the input layer, layer[l] for l = 1..layers is computed from
+ * layer[l-1] with width rows of (bias, weights) in genann's order, each
+ * layer's weights 64 byte aligned. Activations are called with a NULL
+ * genann, the built-in ones do not look at it. */
+typedef struct genann_layer {
+    int width;
+    genann_actfun activation;   /* Unused for layer 0 */
+    double *weight;             /* NULL for layer 0 */
+    double *output;
+    double *delta;              /* NULL for layer 0 */
+} genann_layer;
+
+typedef struct genann_net {
+    int layers;                 /* Hidden layers plus the output layer */
+    int total_weights;          /* Not counting the padding between layers */
+    int total_neurons;
+    genann_layer *layer;        /* layers + 1 of them */
+    double *weight;             /* First layer's weights */
+    double *output;             /* Every neuron, the inputs first */
+    double *delta;
+    double *scratch;
+} genann_net;
+
+/* widths has layers + 1 entries, the inputs first and the outputs last;
+ * activations has layers, or is NULL for sigmoid everywhere. */
+genann_net *genann_net_init(int layers, int const *widths, genann_actfun const *activations);
+genann_net *genann_net_from(genann const *ann);
+void genann_net_randomize(genann_net *net);
+double const *genann_net_run(genann_net const *net, double const *inputs);
+void genann_net_train(genann_net const *net, double const *inputs, double const *desired_outputs, double learning_rate);
+void genann_net_free(genann_net *net);
+
+/* float32 copy of a trained network, same layout as the double one.
+ * Like genann_run, genann_run_f32 returns a pointer into its own output. */
+typedef struct genann_f32 {
+    genann shape;           /* Sizes and activations of the source, no pointers */
+    float *weight;
+    float *output;
+    float *temp_i;          /* Scratch, the layer input with -1 in front */
+    double *act_tmp;        /* Scratch, the layer for the activation kernels */
+} genann_f32;
+
+genann_f32 *genann_to_f32(genann const *ann);
+float const *genann_run_f32(genann_f32 const *ann, float const *inputs);
+void genann_free_f32(genann_f32 *ann);
+
+/* int8 quantised copy of a trained network, inference only: weights with
+ * one scale per layer, inputs quantised per layer at run time, int32 sums. */
+typedef struct genann_i8 {
+    genann shape;
+    int8_t *weight;
+    float *scale;           /* Per layer, weight = int8 weight * scale; [0] is unused */
+    float *output;
+    float *temp_i;
+    int8_t *temp_q;         /* Scratch, the quantised layer input with -1 in front */
+    double *act_tmp;
+} genann_i8;
+
+genann_i8 *genann_to_i8(genann const *ann);
+float const *genann_run_i8(genann_i8 const *ann, float const *inputs);
+void genann_free_i8(genann_i8 *ann);
+
+/* Binary model format: a versioned 64 byte header, then the weights as
+ * raw doubles, 64 byte aligned, with a checksum in the header. Both
+ * readers return NULL for a file that does not match. */
+int genann_write_binary(genann const *ann, FILE *out);
+genann *genann_read_binary(FILE *in);
+uint64_t genann_checksum(double const *weights, int count);
+
+/* Maps a binary model read-only and uses its weights in place, so loading
+ * costs no more than the pages genann_run touches. verify checks the
+ * checksum, which reads every weight once. The network can be run and
+ * copied with genann_copy, but not trained, and is released with
+ * genann_unmap instead of genann_free. */
+genann *genann_map(const char *path, int verify);
+void genann_unmap(genann *ann);
+
+/* Per-layer time, FLOPs, weight bytes and GFLOP/s of genann_run and the
+ * forward and backward passes of genann_train, summed over all calls since
+ * the last reset. Only recorded when genann.c is built with
+ * -DGENANN_PROFILE, the dump says "enabled": false otherwise. */
+void genann_profile_reset(void);
+void genann_profile_dump(FILE *out);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /*GENANN_EXT_H*/
@@ -0,0 +1,274 @@
+/*
+ * Synchronous data-parallel SGD for genann over MPI.
+ *
+ *   mpicc -O3 -march=native genann.c genann_mpi.c -o genann_mpi -lopenblas -lm
+ *   OPENBLAS_NUM_THREADS=1 mpirun -np 4 ./genann_mpi -s 65536 -b 64 -e 5
+ *
+ * Rank 0 makes a synthetic data set, labelled by a random "teacher" network
+ * of the same topology, and scatters it over the ranks. The student's initial
+ * weights are broadcast from rank 0, every rank computes the gradient of its
+ * part of each mini-batch, and the gradients are summed with MPI_Allreduce,
+ * so all ranks take the same step and keep identical weights.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <getopt.h>
+#include <mpi.h>
+
+#include "genann.h"
+#include "genann_ext.h"
+
+#define min(x,y) (((x) < (y)) ? (x) : (y))
+#define max(x,y) (((x) > (y)) ? (x) : (y))
+
+
+void options ( int argc, char **argv );
+
+const char *usage =
+"\t-i <int>\t(inputs)\n"
+"\t-l <int>\t(hidden layers)\n"
+"\t-H <int>\t(neurons per hidden layer)\n"
+"\t-o <int>\t(outputs)\n"
+"\t-s <int>\t(samples in the whole data set)\n"
+"\t-b <int>\t(mini-batch size per rank)\n"
+"\t-e <int>\t(epochs)\n"
+"\t-r <double>\t(learning rate)\n"
+"\t-O\t(overlap each gradient reduction with the next mini-batch, one step stale, so keep -r moderate)\n";
+
+
+//Global variables and definitions
+int inputs = 32, hidden_layers = 2, hidden = 128, outputs = 4;
+int samples = 16384;
+int batch_size = 32;
+int epochs = 5;
+double learning_rate = 0.5;
+int overlap = 0;
+
+
+//--------------------------------------------------------------------------
+//------------------------distributed training------------------------------
+//--------------------------------------------------------------------------
+// Gives every rank the weights of root
+void genann_mpi_bcast(genann *ann, int root, MPI_Comm comm)
+{
+    MPI_Bcast(ann->weight, ann->total_weights, MPI_DOUBLE, root, comm);
+}
+
+// weights += learning_rate * mean gradient, the sample count is the last element of sum
+static void genann_mpi_apply(genann const *ann, double const *sum, double learning_rate)
+{
+    const double count = sum[ann->total_weights];
+    if (count <= 0.0)
+        return;
+    const double rate = learning_rate / count;
+    for (int i = 0; i < ann->total_weights; i++)
+        ann->weight[i] += rate * sum[i];
+}
+
+/*
+ * One epoch over this rank's `samples` samples, mini-batches of batch_size
+ * per rank, so a step covers batch_size * ranks samples. Ranks with fewer
+ * samples contribute empty gradients once they run out, so every rank makes
+ * the same number of reductions.
+ *
+ * With overlap, the reduction of a step's gradient is started with
+ * MPI_Iallreduce and only waited for after the next gradient is computed,
+ * which therefore uses weights one step behind. Stale gradients tolerate
+ * less: on the default problem a rate of 1.0 trains synchronously but
+ * saturates the sigmoids with overlap, 0.5 works for both.
+ */
+void genann_train_mpi(genann const *ann, double const *inputs, double const *desired_outputs,
+        int samples, int batch_size, double learning_rate, MPI_Comm comm, int overlap)
+{
+    const int nw = ann->total_weights;
+    int steps = (samples + batch_size - 1) / batch_size, max_steps;
+    MPI_Allreduce(&steps, &max_steps, 1, MPI_INT, MPI_MAX, comm);
+
+    // The gradient with the sample count appended, so one reduction gives both.
+    // Two of each, so one can be in flight while the other is filled.
+    double *grad[2], *sum[2];
+    double *buf = malloc(sizeof(double) * 4 * (nw + 1));
+    double *work = malloc(sizeof(double) * genann_batch_work_size(ann, batch_size));
+    for (int b = 0; b < 2; b++) {
+        grad[b] = buf + 2 * b * (nw + 1);
+        sum[b] = grad[b] + nw + 1;
+    }
+
+    MPI_Request request = MPI_REQUEST_NULL;
+    int cur = 0;
+    for (int step = 0; step < max_steps; step++) {
+        const int first = step * batch_size;
+        const int count = max(0, min(batch_size, samples - first));
+        double *g = grad[cur];
+
+        if (count > 0)
+            genann_batch_gradient(ann, inputs + (size_t)first * ann->inputs,
+                    desired_outputs + (size_t)first * ann->outputs, count, work, g, 1.0, 0.0);
+        else
+            memset(g, 0, sizeof(double) * nw);
+        g[nw] = count;
+
+        if (!overlap) {
+            MPI_Allreduce(g, sum[cur], nw + 1, MPI_DOUBLE, MPI_SUM, comm);
+            genann_mpi_apply(ann, sum[cur], learning_rate);
+        } else {
+            // The previous reduction ran while this gradient was computed
+            if (request != MPI_REQUEST_NULL) {
+                MPI_Wait(&request, MPI_STATUS_IGNORE);
+                genann_mpi_apply(ann, sum[1 - cur], learning_rate);
+            }
+            MPI_Iallreduce(g, sum[cur], nw + 1, MPI_DOUBLE, MPI_SUM, comm, &request);
+            cur = 1 - cur;
+        }
+    }
+    if (request != MPI_REQUEST_NULL) {
+        MPI_Wait(&request, MPI_STATUS_IGNORE);
+        genann_mpi_apply(ann, sum[1 - cur], learning_rate);
+    }
+
+    free(work);
+    free(buf);
+}
+
+// Sum of squared output errors over this rank's samples
+static double squared_error(genann const *ann, double const *in, double const *target, int count)
+{
+    double err = 0.0;
+    for (int s = 0; s < count; s++) {
+        double const *o = genann_run(ann, in + (size_t)s * ann->inputs);
+        for (int j = 0; j < ann->outputs; j++) {
+            double d = o[j] - target[(size_t)s * ann->outputs + j];
+            err += d * d;
+        }
+    }
+    return err;
+}
+
+
+int main ( int argc, char **argv )
+{
+    int world_sz, world_rank;
+
+    MPI_Init(&argc, &argv);
+    MPI_Comm_size(MPI_COMM_WORLD, &world_sz);
+    MPI_Comm_rank(MPI_COMM_WORLD, &world_rank);
+
+    options ( argc, argv );
+
+    // Samples per rank, the first samples % world_sz ranks get one more
+    int *counts = malloc(sizeof(int) * world_sz);
+    int *in_counts = malloc(sizeof(int) * world_sz), *in_displs = malloc(sizeof(int) * world_sz);
+    int *out_counts = malloc(sizeof(int) * world_sz), *out_displs = malloc(sizeof(int) * world_sz);
+    for (int r = 0, first = 0; r < world_sz; r++) {
+        counts[r] = samples / world_sz + (r < samples % world_sz);
+        in_counts[r] = counts[r] * inputs;
+        in_displs[r] = first * inputs;
+        out_counts[r] = counts[r] * outputs;
+        out_displs[r] = first * outputs;
+        first += counts[r];
+    }
+    const int my_samples = counts[world_rank];
+
+    double *all_in = NULL, *all_out = NULL;
+    if (world_rank == 0) {
+        srand ( 1 );
+        genann *teacher = genann_init(inputs, hidden_layers, hidden, outputs);
+        for (int i = 0; i < teacher->total_weights; i++)
+            teacher->weight[i] *= 4.0;      // Steeper than the student's start, so there is something to learn
+        all_in = malloc(sizeof(double) * samples * inputs);
+        all_out = malloc(sizeof(double) * samples * outputs);
+        for (long i = 0; i < (long)samples * inputs; i++)
+            all_in[i] = (double)rand() / RAND_MAX;
+        genann_run_batch(teacher, all_in, samples, all_out, NULL);
+        genann_free(teacher);
+    }
+
+    double *my_in = malloc(sizeof(double) * (my_samples * inputs + 1));
+    double *my_out = malloc(sizeof(double) * (my_samples * outputs + 1));
+    MPI_Scatterv(all_in, in_counts, in_displs, MPI_DOUBLE,
+            my_in, in_counts[world_rank], MPI_DOUBLE, 0, MPI_COMM_WORLD);
+    MPI_Scatterv(all_out, out_counts, out_displs, MPI_DOUBLE,
+            my_out, out_counts[world_rank], MPI_DOUBLE, 0, MPI_COMM_WORLD);
+
+    // Each rank seeds differently, the broadcast makes the start the same
+    srand ( 100 + world_rank );
+    genann *ann = genann_init(inputs, hidden_layers, hidden, outputs);
+    genann_mpi_bcast(ann, 0, MPI_COMM_WORLD);
+
+    if (world_rank == 0)
+        printf("ranks=%d inputs=%d hidden_layers=%d hidden=%d outputs=%d weights=%d samples=%d batch=%dx%d overlap=%s\n",
+                world_sz, inputs, hidden_layers, hidden, outputs, ann->total_weights,
+                samples, batch_size, world_sz, overlap ? "yes" : "no");
+
+    double local, mse;
+    local = squared_error(ann, my_in, my_out, my_samples);
+    MPI_Reduce(&local, &mse, 1, MPI_DOUBLE, MPI_SUM, 0, MPI_COMM_WORLD);
+    if (world_rank == 0)
+        printf("Epoch %3d\tMSE: %e\n", 0, mse / ((double)samples * outputs));
+
+    double total_time = 0.0;
+    for (int e = 1; e <= epochs; e++) {
+        MPI_Barrier(MPI_COMM_WORLD);
+        double starttime = MPI_Wtime();
+        genann_train_mpi(ann, my_in, my_out, my_samples, batch_size, learning_rate, MPI_COMM_WORLD, overlap);
+        MPI_Barrier(MPI_COMM_WORLD);
+        double time = MPI_Wtime() - starttime;
+        total_time += time;
+
+        local = squared_error(ann, my_in, my_out, my_samples);
+        MPI_Reduce(&local, &mse, 1, MPI_DOUBLE, MPI_SUM, 0, MPI_COMM_WORLD);
+        if (world_rank == 0)
+            printf("Epoch %3d\tMSE: %e\tTime: %f s\tSamples/s: %.0f\n",
+                    e, mse / ((double)samples * outputs), time, samples / time);
+    }
+
+    // Every rank applied the same sums, so the weights must still agree
+    double check = 0.0, lo, hi;
+    for (int i = 0; i < ann->total_weights; i++)
+        check += ann->weight[i] * (i + 1);
+    MPI_Reduce(&check, &lo, 1, MPI_DOUBLE, MPI_MIN, 0, MPI_COMM_WORLD);
+    MPI_Reduce(&check, &hi, 1, MPI_DOUBLE, MPI_MAX, 0, MPI_COMM_WORLD);
+    if (world_rank == 0) {
+        printf("Weights identical on all ranks: %s\n", lo == hi ? "yes" : "NO");
+        printf("Total: %f s\tSamples/s: %.0f\n", total_time, (double)samples * epochs / total_time);
+    }
+
+    genann_free(ann);
+    free(my_in);
+    free(my_out);
+    free(all_in);
+    free(all_out);
+    free(counts);
+    free(in_counts);
+    free(in_displs);
+    free(out_counts);
+    free(out_displs);
+
+    MPI_Finalize();
+    return 0;
+}
+
+
+void options ( int argc, char **argv )
+{
+    int o;
+    while ( (o = getopt(argc,argv,"i:l:H:o:s:b:e:r:Oh")) != -1 )
+    switch ( o )
+    {
+        case 'i': inputs = max ( 1, strtol ( optarg, NULL, 10 ) ); break;
+        case 'l': hidden_layers = max ( 0, strtol ( optarg, NULL, 10 ) ); break;
+        case 'H': hidden = max ( 1, strtol ( optarg, NULL, 10 ) ); break;
+        case 'o': outputs = max ( 1, strtol ( optarg, NULL, 10 ) ); break;
+        case 's': samples = max ( 1, strtol ( optarg, NULL, 10 ) ); break;
+        case 'b': batch_size = max ( 1, strtol ( optarg, NULL, 10 ) ); break;
+        case 'e': epochs = max ( 1, strtol ( optarg, NULL, 10 ) ); break;
+        case 'r': learning_rate = strtod ( optarg, NULL ); break;
+        case 'O': overlap = 1; break;
+        case 'h':
+            fprintf ( stderr, "%s", usage );
+            MPI_Abort ( MPI_COMM_WORLD, EXIT_FAILURE );
+            break;
+    }
+}
@@ -1,34 +1,81 @@
-#define _XOPEN_SOURCE 500
+#define _GNU_SOURCE     // CPU_SET, pthread_setaffinity_np
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
-#include <sys/time.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
 #include <getopt.h>
 #include <pthread.h>
 #include <cblas.h>
 #include <omp.h>
+#include <immintrin.h>
+#include <sched.h>
+#include <unistd.h>
+#ifdef HAVE_LIBNUMA
+#include <numa.h>
+#include <numaif.h>
+#endif
 
-#define WALLTIME(t) ((double)(t).tv_sec + 1e-6 * (double)(t).tv_usec)
 #define min(x,y) (((x) < (y)) ? (x) : (y))
+#define max(x,y) (((x) > (y)) ? (x) : (y))
+#define MAX_SWEEP 16
 
 
 void options ( int argc, char **argv );
 
 const char *usage =
-"\t-k <int>\n"
-"\t-m <int>\n"
-"\t-n <int>\n"
-"\t-t <int>\n";
+"\t-k <int>[,<int>...]\t(sizes and thread counts take a comma separated sweep)\n"
+"\t-m <int>[,<int>...]\n"
+"\t-n <int>[,<int>...]\n"
+"\t-t <int>[,<int>...]\n"
+"\t-w <int>\t(untimed warm-up calls per variant)\n"
+"\t-r <int>\t(timed calls per variant, median and p95 are reported)\n"
+"\t-p f64|f32|bf16\t(element type, f32 and bf16 accumulate in f32, BLAS bf16 needs -DHAVE_SBGEMM)\n"
+"\t-e <double>\t(max relative error accepted against the f64 result, default depends on -p)\n"
+"\t-o csv|json\t(one record per variant and configuration, json is one object per line)\n"
+"\t-f <file>\t(append the csv/json records to file instead of stdout)\n"
+"\t-v\t(run the blocked SIMD engine)\n"
+"\t-s <int>\t(run the cache-oblivious recursive GEMM, Strassen-Winograd levels while every size >= int, 0 for none)\n"
+"\t-b <int>\t(batched mode: that many independent m x n x k products, f64 only)\n"
+"\t-a none|compact|scatter\t(pin workers to cores in order, or round robin over NUMA nodes)\n"
+"\t-N\t(also run with parallel first-touch initialisation and pinning, report the gain and page placement)\n";
 
 
 //Global variables and definitions
 int num_threads = 4;
+bool run_blocked = false;
+int warmups = 1;
+int repeats = 5;
+double tolerance = -1.0;       // < 0: use the default for the precision
+
+typedef enum { PREC_F64, PREC_F32, PREC_BF16 } precision_t;
+precision_t precision = PREC_F64;
+const char *precision_names[] = { "f64", "f32", "bf16" };
+// Input rounding dominates for the low precisions: 2^-24 for f32 and 2^-9 for bf16
+const double precision_tolerance[] = { 1e-12, 1e-5, 1e-2 };
+
+enum { OUT_TEXT, OUT_CSV, OUT_JSON } output_format = OUT_TEXT;
+char *output_file = NULL;
+
+int sweep_m[MAX_SWEEP] = {1024}, sweep_n[MAX_SWEEP] = {1024}, sweep_k[MAX_SWEEP] = {1024};
+int sweep_t[MAX_SWEEP] = {4};
+int num_m = 1, num_n = 1, num_k = 1, num_t = 1;
+bool numa_compare = false;     // Run every configuration with the serial and the first-touch layout
+int batch = 1;      // > 1 selects the batched benchmark, A, B and the C buffers then hold batch matrices each
 
 double
     *A, *B,
-    *C_serial, *C_openmp, *C_pthreads, *C_blas,
+    *C_serial, *C_openmp, *C_pthreads, *C_blas, *C_blocked,
+    *C_ref,     // f64 reference, the manual result itself when -p f64
+    *C_batch_strided, *C_batch_ptr,
     alpha = 1.0, beta = 0.0;
 
+// A and B rounded to the selected precision, unused for f64.
+// For f32 and bf16 the C buffers above hold floats.
+void *A_lp, *B_lp;
+
 int
     m = 1024, n = 1024, k = 1024;
 
@@ -60,130 +107,690 @@ void print_matrices()
 	}
 }
 
-//TODO: Pthreads - function
-void* calc_matrix_part(void* thread_number){
-
-    int* thread_num_p = (int*) thread_number;
-    int rows_per_t = -1;
-    int remainder = m % num_threads; // This will be the last threads' amount of extra rows to calculate
-    if(remainder == 0){
-        rows_per_t = m / num_threads;
-    } else{
-        rows_per_t = (m-remainder) / (num_threads);
-    }
-
-    int start = *thread_num_p * rows_per_t; // Find offset to start from for each thread
-    int end = (*thread_num_p == num_threads - 1) ? start + rows_per_t + remainder : start + rows_per_t;
-    for (int s = start; s < end; s++) {
-        for (int t = 0; t < n; t++) {
-            double sum = 0;
-            for (int u = 0; u < k; u++) {
-                sum = sum + A[s * k + u] * B[u * n + t];
-            }
-            C_pthreads[s * n + t] = sum;
-        }
+//--------------------------------------------------------------------------
+//------------------------precision-----------------------------------------
+//--------------------------------------------------------------------------
+// Round to nearest even, inputs are never NaN here
+static inline bfloat16 float_to_bf16(float f)
+{
+    uint32_t u;
+    memcpy(&u, &f, sizeof(u));
+    u += 0x7fff + ((u >> 16) & 1);
+    return (bfloat16)(u >> 16);
+}
+
+static inline float bf16_to_float(bfloat16 h)
+{
+    uint32_t u = (uint32_t)h << 16;
+    float f;
+    memcpy(&f, &u, sizeof(f));
+    return f;
+}
+
+size_t input_size(void)  { return precision == PREC_F64 ? sizeof(double) : precision == PREC_F32 ? sizeof(float) : sizeof(bfloat16); }
+size_t output_size(void) { return precision == PREC_F64 ? sizeof(double) : sizeof(float); }
+
+// Element i of a C buffer as a double, whatever the precision
+static inline double c_at(double const *C, long i)
+{
+    return precision == PREC_F64 ? C[i] : (double)((float const *)C)[i];
+}
+
+#define AS_IS(x) (x)
+
+// The textbook i-j-p loop over rows [i0, i1) and columns [j0, j1) of C
+#define DEFINE_NAIVE_GEMM(name, in_t, acc_t, out_t, LOAD)                                 \
+static void name(in_t const *A, in_t const *B, out_t *C, int i0, int i1, int j0, int j1) \
+{                                                                                         \
+    for (int i = i0; i < i1; i++) {                                                       \
+        for (int j = j0; j < j1; j++) {                                                   \
+            acc_t sum = 0;                                                                \
+            for (int p = 0; p < k; p++) {                                                 \
+                sum = sum + LOAD(A[i * k + p]) * LOAD(B[p * n + j]);                      \
+            }                                                                             \
+            C[i * n + j] = sum;                                                           \
+        }                                                                                 \
+    }                                                                                     \
+}
+
+DEFINE_NAIVE_GEMM(naive_gemm_f64, double, double, double, AS_IS)
+DEFINE_NAIVE_GEMM(naive_gemm_f32, float, float, float, AS_IS)
+DEFINE_NAIVE_GEMM(naive_gemm_bf16, bfloat16, float, float, bf16_to_float)
+
+void naive_gemm(double *C, int i0, int i1, int j0, int j1)
+{
+    switch (precision) {
+    case PREC_F64:  naive_gemm_f64(A, B, C, i0, i1, j0, j1); break;
+    case PREC_F32:  naive_gemm_f32(A_lp, B_lp, (float *)C, i0, i1, j0, j1); break;
+    case PREC_BF16: naive_gemm_bf16(A_lp, B_lp, (float *)C, i0, i1, j0, j1); break;
     }
+}
+
+// Round A and B into A_lp and B_lp
+static void convert_inputs(void)
+{
+    long size_a = (long)m * k, size_b = (long)k * n;
+    if (precision == PREC_F64)
+        return;
+
+    A_lp = malloc(size_a * input_size());
+    B_lp = malloc(size_b * input_size());
+    for (long i = 0; i < size_a; i++) {
+        if (precision == PREC_F32)
+            ((float *)A_lp)[i] = (float)A[i];
+        else
+            ((bfloat16 *)A_lp)[i] = float_to_bf16((float)A[i]);
+    }
+    for (long i = 0; i < size_b; i++) {
+        if (precision == PREC_F32)
+            ((float *)B_lp)[i] = (float)B[i];
+        else
+            ((bfloat16 *)B_lp)[i] = float_to_bf16((float)B[i]);
+    }
+}
+
+//--------------------------------------------------------------------------
+//------------------------thread placement----------------------------------
+//--------------------------------------------------------------------------
+/*
+ * Worker w of the pool and thread w of the OpenMP team are pinned to the
+ * same core, so rows that thread w first-touches are local to whichever
+ * engine later works on them. Node information needs -DHAVE_LIBNUMA -lnuma,
+ * without it every core is taken to be on node 0.
+ */
+typedef enum { AFFINITY_NONE, AFFINITY_COMPACT, AFFINITY_SCATTER } affinity_t;
+affinity_t affinity = AFFINITY_NONE;
+const char *affinity_names[] = { "none", "compact", "scatter" };
+
+bool pin_threads = false;       // Pin new pools and the OpenMP team according to affinity
+bool first_touch = false;       // Matrices are initialised by the thread that works on them
+
+cpu_set_t initial_cpus;         // What the process was allowed to run on at start-up
+int *worker_cpu;                // Core for worker w, w taken modulo num_worker_cpus
+int num_worker_cpus;
+
+static int node_of_cpu(int cpu)
+{
+#ifdef HAVE_LIBNUMA
+    if (numa_available() >= 0)
+        return max(0, numa_node_of_cpu(cpu));
+#endif
     return 0;
 }
 
+static void init_worker_cpus(void)
+{
+    int cpus[CPU_SETSIZE], nodes = 1;
 
-//TODO end
+    sched_getaffinity(0, sizeof(initial_cpus), &initial_cpus);
+    num_worker_cpus = 0;
+    for (int c = 0; c < CPU_SETSIZE; c++)
+        if (CPU_ISSET(c, &initial_cpus)) {
+            cpus[num_worker_cpus++] = c;
+            nodes = max(nodes, node_of_cpu(c) + 1);
+        }
 
-int main ( int argc, char **argv )
+    worker_cpu = malloc(sizeof(int) * num_worker_cpus);
+    if (affinity != AFFINITY_SCATTER || nodes == 1) {
+        memcpy(worker_cpu, cpus, sizeof(int) * num_worker_cpus);
+        return;
+    }
+
+    // Take the i-th core of every node in turn
+    int w = 0;
+    for (int i = 0; w < num_worker_cpus; i++)
+        for (int node = 0; node < nodes; node++) {
+            int seen = 0;
+            for (int c = 0; c < num_worker_cpus; c++)
+                if (node_of_cpu(cpus[c]) == node && seen++ == i) {
+                    worker_cpu[w++] = cpus[c];
+                    break;
+                }
+        }
+}
+
+// Pin the calling thread as worker w, or let it run anywhere again
+static void pin_worker(int w, bool pin)
 {
-    options ( argc, argv );
-    A = (double *)malloc( m*k*sizeof( double ) );
-    B = (double *)malloc( k*n*sizeof( double ) );
-    C_serial = (double *)malloc( m*n*sizeof( double ) );
-    C_openmp = (double *)malloc( m*n*sizeof( double ) );
-    C_pthreads = (double *)malloc( m*n*sizeof( double ) );
-    C_blas = (double *)malloc( m*n*sizeof( double ) );
+    cpu_set_t set = initial_cpus;
+    if (pin && affinity != AFFINITY_NONE) {
+        CPU_ZERO(&set);
+        CPU_SET(worker_cpu[w % num_worker_cpus], &set);
+    }
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+}
 
-    int i, j;
+static void pin_openmp_team(bool pin)
+{
+    #pragma omp parallel
+    pin_worker(omp_get_thread_num(), pin);
+}
 
-    /* Initialize with dummy data */
-    for ( i = 0; i < (m*k); i++ )
-        A[i] = (double)(i+1);
-    for ( i = 0; i < (k*n); i++ )
-        B[i] = (double)(-i-1);
-    for ( i = 0; i < (m*n); i++ ){
-        C_serial[i] = 0.0;
-        C_openmp [i] = 0.0;
-        C_pthreads[i] = 0.0;
-        C_blas[i] = 0.0;
-    }
-
-    struct timeval start, end;
-
-    double total_time_serial = 0;
-    double total_time_openmp = 0;
-    double total_time_pthreads = 0;
-    double total_time_blas = 0;
-
-    /*
-     * DGEMM (Double-precision GEneral Matrix Multiply)
-     * Example: A general multiplication between two matricies A and B, accumulating in C.
-     */
-    // A has m rows and k columns
-    // B has k rows and n columns
-    // C has m rows and n columns
-    double sum = 0;
-    int p;
-
-
-    gettimeofday( &start, NULL );
-    for (i = 0; i < m; i++) {
-    	for (j = 0; j < n; j++) {
-    	    sum = 0;
-    	    for (p = 0; p < k; p++) {
-                sum = sum + A[i * k + p] * B[p * n + j];
-    	    }
-    	    C_serial[i * n + j] = sum;
+// Print the share of the pages of buf on each node
+static void report_placement(const char *name, void const *buf, size_t bytes)
+{
+#ifdef HAVE_LIBNUMA
+    long page = sysconf(_SC_PAGESIZE);
+    char *first = (char *)((uintptr_t)buf & ~(uintptr_t)(page - 1));
+    unsigned long count = ((char const *)buf + bytes - first + page - 1) / page;
+    void **pages = malloc(sizeof(void *) * count);
+    int *status = malloc(sizeof(int) * count);
+    int nodes = numa_num_configured_nodes();
+    long *per_node = calloc(nodes, sizeof(long));
+
+    for (unsigned long i = 0; i < count; i++)
+        pages[i] = first + i * page;
+    // With no target nodes move_pages only reports where each page is
+    if (move_pages(0, count, pages, NULL, status, 0) == 0) {
+        for (unsigned long i = 0; i < count; i++)
+            if (status[i] >= 0 && status[i] < nodes)
+                per_node[status[i]]++;
+        printf("  %-12s", name);
+        for (int node = 0; node < nodes; node++)
+            printf(" node%d: %5.1lf%%", node, 100.0 * per_node[node] / count);
+        printf("\n");
+    }
+    free(pages);
+    free(status);
+    free(per_node);
+#else
+    (void)buf;
+    (void)bytes;
+    printf("  %-12s page placement needs -DHAVE_LIBNUMA -lnuma\n", name);
+#endif
+}
+
+//--------------------------------------------------------------------------
+//------------------------work-stealing thread pool-------------------------
+//--------------------------------------------------------------------------
+/*
+ * A persistent pool of num_threads workers (the calling thread is worker 0).
+ * pool_run() deals tasks 0..ntasks-1 out as contiguous ranges, one per
+ * worker deque. Owners pop from the tail of their own range, idle workers
+ * steal from the head of someone else's, so an uneven split evens itself
+ * out and no threads are created or joined per call.
+ */
+typedef void (*pool_task_fn)(void *arg, int task, int worker);
+
+typedef struct {
+    pthread_mutex_t lock;
+    int head, tail;             // Remaining tasks are [head, tail)
+} pool_deque;
+
+typedef struct thread_pool thread_pool;
+
+typedef struct {
+    thread_pool *pool;
+    int id;
+} pool_worker;
+
+struct thread_pool {
+    int num_workers;
+    pthread_t *threads;
+    pool_worker *workers;
+    pool_deque *deques;
+
+    pthread_mutex_t lock;
+    pthread_cond_t wake, done;
+    unsigned long generation;   // Bumped once per pool_run
+    int busy;                   // Helper threads still working on this generation
+    bool shutdown;
+
+    pool_task_fn fn;
+    void *arg;
+    bool pinned;                // Workers pinned with pin_worker, undone by pool_destroy
+};
+
+thread_pool *pool;
+
+static bool deque_take(pool_deque *d, bool steal, int *task)
+{
+    bool ok = false;
+    pthread_mutex_lock(&d->lock);
+    if (d->head < d->tail) {
+        *task = steal ? d->head++ : --d->tail;
+        ok = true;
+    }
+    pthread_mutex_unlock(&d->lock);
+    return ok;
+}
+
+// Drain own deque, then steal until every deque is empty
+static void pool_work(thread_pool *p, int id)
+{
+    int task;
+    for (;;) {
+        if (!deque_take(&p->deques[id], false, &task)) {
+            bool stolen = false;
+            for (int v = 1; v < p->num_workers && !stolen; v++)
+                stolen = deque_take(&p->deques[(id + v) % p->num_workers], true, &task);
+            if (!stolen)
+                return;
         }
+        p->fn(p->arg, task, id);
     }
-    gettimeofday ( &end, NULL );
-    total_time_serial = (WALLTIME(end)-WALLTIME(start));
-    //print_matrices();
+}
 
+static void *pool_thread(void *arg)
+{
+    thread_pool *p = ((pool_worker *)arg)->pool;
+    int id = ((pool_worker *)arg)->id;
+    unsigned long seen = 0;
 
-//TODO: OpenMP
+    if (p->pinned)
+        pin_worker(id, true);
+
+    for (;;) {
+        pthread_mutex_lock(&p->lock);
+        while (!p->shutdown && p->generation == seen)
+            pthread_cond_wait(&p->wake, &p->lock);
+        if (p->shutdown) {
+            pthread_mutex_unlock(&p->lock);
+            return NULL;
+        }
+        seen = p->generation;
+        pthread_mutex_unlock(&p->lock);
+
+        pool_work(p, id);
+
+        pthread_mutex_lock(&p->lock);
+        if (--p->busy == 0)
+            pthread_cond_signal(&p->done);
+        pthread_mutex_unlock(&p->lock);
+    }
+}
+
+thread_pool *pool_create(int num_workers)
+{
+    thread_pool *p = malloc(sizeof(thread_pool));
+    p->num_workers = num_workers;
+    p->threads = malloc(sizeof(pthread_t) * num_workers);
+    p->workers = malloc(sizeof(pool_worker) * num_workers);
+    p->deques = malloc(sizeof(pool_deque) * num_workers);
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->wake, NULL);
+    pthread_cond_init(&p->done, NULL);
+    p->generation = 0;
+    p->busy = 0;
+    p->shutdown = false;
+    p->pinned = pin_threads && affinity != AFFINITY_NONE;
+
+    for (int i = 0; i < num_workers; i++) {
+        pthread_mutex_init(&p->deques[i].lock, NULL);
+        p->deques[i].head = p->deques[i].tail = 0;
+        p->workers[i].pool = p;
+        p->workers[i].id = i;
+    }
+    // Worker 0 is whoever calls pool_run
+    if (p->pinned)
+        pin_worker(0, true);
+    for (int i = 1; i < num_workers; i++)
+        pthread_create(&p->threads[i], NULL, pool_thread, &p->workers[i]);
+
+    return p;
+}
+
+// Run fn(arg, task, worker) for every task in [0, ntasks) and wait for all of them
+void pool_run(thread_pool *p, int ntasks, pool_task_fn fn, void *arg)
+{
+    for (int i = 0; i < p->num_workers; i++) {
+        p->deques[i].head = (int)((long)ntasks * i / p->num_workers);
+        p->deques[i].tail = (int)((long)ntasks * (i + 1) / p->num_workers);
+    }
+
+    pthread_mutex_lock(&p->lock);
+    p->fn = fn;
+    p->arg = arg;
+    p->busy = p->num_workers - 1;
+    p->generation++;
+    pthread_cond_broadcast(&p->wake);
+    pthread_mutex_unlock(&p->lock);
+
+    pool_work(p, 0);
+
+    pthread_mutex_lock(&p->lock);
+    while (p->busy > 0)
+        pthread_cond_wait(&p->done, &p->lock);
+    pthread_mutex_unlock(&p->lock);
+}
+
+void pool_destroy(thread_pool *p)
+{
+    pthread_mutex_lock(&p->lock);
+    p->shutdown = true;
+    pthread_cond_broadcast(&p->wake);
+    pthread_mutex_unlock(&p->lock);
+
+    for (int i = 1; i < p->num_workers; i++)
+        pthread_join(p->threads[i], NULL);
+    if (p->pinned)
+        pin_worker(0, false);
+    for (int i = 0; i < p->num_workers; i++)
+        pthread_mutex_destroy(&p->deques[i].lock);
+    pthread_mutex_destroy(&p->lock);
+    pthread_cond_destroy(&p->wake);
+    pthread_cond_destroy(&p->done);
+    free(p->threads);
+    free(p->workers);
+    free(p->deques);
+    free(p);
+}
+
+// Same task functions on either the pool or an OpenMP team
+void parallel_for(thread_pool *p, int ntasks, pool_task_fn fn, void *arg)
+{
+    if (p) {
+        pool_run(p, ntasks, fn, arg);
+        return;
+    }
+    #pragma omp parallel for schedule(dynamic)
+    for (int t = 0; t < ntasks; t++)
+        fn(arg, t, omp_get_thread_num());
+}
+
+
+//TODO: Pthreads - function
+#define TILE_ROWS 32
+#define TILE_COLS 128
+
+// One TILE_ROWS x TILE_COLS tile of C_pthreads, tiles numbered row-major
+void calc_matrix_part(void *arg, int tile, int worker){
+    int tiles_per_row = (n + TILE_COLS - 1) / TILE_COLS;
+    int row_start = (tile / tiles_per_row) * TILE_ROWS;
+    int col_start = (tile % tiles_per_row) * TILE_COLS;
+    int row_end = min(row_start + TILE_ROWS, m);
+    int col_end = min(col_start + TILE_COLS, n);
+
+    naive_gemm(C_pthreads, row_start, row_end, col_start, col_end);
+}
 
-    omp_set_num_threads(num_threads);
-
-    gettimeofday( &start, NULL );
-    #pragma omp parallel for 
-    for (i = 0; i < m; i++) {
-    	for (j = 0; j < n; j++) {
-    	    sum = 0;
-    	    for (p = 0; p < k; p++) {
-                sum = sum + A[i * k + p] * B[p * n + j];
-    	    }
-    	    C_openmp[i * n + j] = sum;
-    	}
-    }
-    gettimeofday ( &end, NULL );
-    total_time_openmp = (WALLTIME(end)-WALLTIME(start));
 //TODO end
 
 
-//TODO: Pthreads - spawn threads
-    gettimeofday( &start, NULL );
-    pthread_t* threads = malloc(sizeof(pthread_t)*num_threads);
-    int* thread_nums = malloc(sizeof(int)*num_threads);
+//--------------------------------------------------------------------------
+//------------------------blocked SIMD engine-------------------------------
+//--------------------------------------------------------------------------
+/*
+ * GotoBLAS-style DGEMM: C is walked in NC-wide column panels, the k
+ * dimension in KC-deep slabs. Each KC x NC slab of B is packed once into
+ * NR-wide micro-panels (lives in L3), each MC x KC block of A is packed per
+ * thread into MR-tall micro-panels (lives in L2), and the micro-kernel keeps
+ * an MR x NR tile of C in registers while streaming one micro-panel of each.
+ *
+ * Build with -march=native (or -mavx2 -mfma / -mavx512f) to get the FMA
+ * kernels, otherwise the portable scalar kernel is used.
+ */
+#if defined(__AVX512F__)
+#define GEMM_MR 12
+#define GEMM_NR 16
+#define GEMM_VLEN 8
+typedef __m512d gemm_vec;
+#define gemm_vload(p)           _mm512_load_pd(p)
+#define gemm_vloadu(p)          _mm512_loadu_pd(p)
+#define gemm_vstoreu(p, v)      _mm512_storeu_pd(p, v)
+#define gemm_vbcast(x)          _mm512_set1_pd(x)
+#define gemm_vzero()            _mm512_setzero_pd()
+#define gemm_vfma(a, b, c)      _mm512_fmadd_pd(a, b, c)
+#define gemm_vmul(a, b)         _mm512_mul_pd(a, b)
+#elif defined(__AVX2__) && defined(__FMA__)
+#define GEMM_MR 6
+#define GEMM_NR 8
+#define GEMM_VLEN 4
+typedef __m256d gemm_vec;
+#define gemm_vload(p)           _mm256_load_pd(p)
+#define gemm_vloadu(p)          _mm256_loadu_pd(p)
+#define gemm_vstoreu(p, v)      _mm256_storeu_pd(p, v)
+#define gemm_vbcast(x)          _mm256_set1_pd(x)
+#define gemm_vzero()            _mm256_setzero_pd()
+#define gemm_vfma(a, b, c)      _mm256_fmadd_pd(a, b, c)
+#define gemm_vmul(a, b)         _mm256_mul_pd(a, b)
+#else
+#define GEMM_MR 4
+#define GEMM_NR 4
+#endif
+
+#define GEMM_MC 120     // MC x KC block of A, ~240KB, sized for L2
+#define GEMM_KC 256     // KC x NR micro-panel of B, ~32KB, sized for L1
+#define GEMM_NC 2048    // KC x NC slab of B, ~4MB, sized for L3
+
+static void *gemm_alloc(size_t bytes)
+{
+    // aligned_alloc wants a multiple of the alignment
+    return aligned_alloc(64, (bytes + 63) & ~(size_t)63);
+}
+
+// Pack an mc x kc block of A into MR-tall panels, column by column, zero padded
+static void pack_A(int mc, int kc, const double *A, int lda, double *buf)
+{
+    for (int i = 0; i < mc; i += GEMM_MR) {
+        int mr = min(GEMM_MR, mc - i);
+        for (int p = 0; p < kc; p++) {
+            int r;
+            for (r = 0; r < mr; r++)
+                buf[r] = A[(i + r) * lda + p];
+            for (; r < GEMM_MR; r++)
+                buf[r] = 0.0;
+            buf += GEMM_MR;
+        }
+    }
+}
+
+// Pack a kc x nc slab of B into NR-wide panels, row by row, zero padded
+static void pack_B_panel(int kc, int nr, const double *B, int ldb, double *buf)
+{
+    for (int p = 0; p < kc; p++) {
+        int c;
+        for (c = 0; c < nr; c++)
+            buf[c] = B[p * ldb + c];
+        for (; c < GEMM_NR; c++)
+            buf[c] = 0.0;
+        buf += GEMM_NR;
+    }
+}
+
+// C[MR x NR] += alpha * a_panel * b_panel, written to an ldc-strided tile
+static void micro_kernel(int kc, const double *a, const double *b, double *c, int ldc, double alpha)
+{
+#ifdef GEMM_VLEN
+    gemm_vec acc[GEMM_MR][GEMM_NR / GEMM_VLEN];
+    for (int r = 0; r < GEMM_MR; r++)
+        for (int v = 0; v < GEMM_NR / GEMM_VLEN; v++)
+            acc[r][v] = gemm_vzero();
+
+    for (int p = 0; p < kc; p++) {
+        gemm_vec bv[GEMM_NR / GEMM_VLEN];
+        for (int v = 0; v < GEMM_NR / GEMM_VLEN; v++)
+            bv[v] = gemm_vload(b + v * GEMM_VLEN);
+        for (int r = 0; r < GEMM_MR; r++) {
+            gemm_vec av = gemm_vbcast(a[r]);
+            for (int v = 0; v < GEMM_NR / GEMM_VLEN; v++)
+                acc[r][v] = gemm_vfma(av, bv[v], acc[r][v]);
+        }
+        a += GEMM_MR;
+        b += GEMM_NR;
+    }
+
+    gemm_vec va = gemm_vbcast(alpha);
+    for (int r = 0; r < GEMM_MR; r++)
+        for (int v = 0; v < GEMM_NR / GEMM_VLEN; v++) {
+            double *cp = c + r * ldc + v * GEMM_VLEN;
+            gemm_vstoreu(cp, gemm_vfma(va, acc[r][v], gemm_vloadu(cp)));
+        }
+#else
+    double acc[GEMM_MR][GEMM_NR] = {{0}};
+    for (int p = 0; p < kc; p++) {
+        for (int r = 0; r < GEMM_MR; r++)
+            for (int q = 0; q < GEMM_NR; q++)
+                acc[r][q] += a[r] * b[q];
+        a += GEMM_MR;
+        b += GEMM_NR;
+    }
+    for (int r = 0; r < GEMM_MR; r++)
+        for (int q = 0; q < GEMM_NR; q++)
+            c[r * ldc + q] += alpha * acc[r][q];
+#endif
+}
+
+#define GEMM_TILE_N (GEMM_NR * 16)   // Column width of one macro-tile task
+
+typedef struct {
+    int m, n, k, lda, ldb, ldc;
+    double alpha, beta;
+    const double *A, *B;
+    double *C;
+
+    int jc, nc, pc, kc;         // Slab of B currently packed
+    double *packed_B;
+    double **packed_A;          // One MC x KC block per worker
+    int *packed_ic;             // Which block of A each worker has packed, -1 if none
+} blocked_gemm;
+
+static void blocked_scale_row(void *arg, int i, int worker)
+{
+    blocked_gemm *g = arg;
+    double *c = &g->C[i * g->ldc];
+    for (int j = 0; j < g->n; j++)
+        c[j] = (g->beta == 0.0) ? 0.0 : g->beta * c[j];
+}
+
+static void blocked_pack_B(void *arg, int panel, int worker)
+{
+    blocked_gemm *g = arg;
+    int jr = panel * GEMM_NR;
+    pack_B_panel(g->kc, min(GEMM_NR, g->nc - jr), &g->B[g->pc * g->ldb + g->jc + jr], g->ldb,
+            &g->packed_B[jr * g->kc]);
+}
+
+// One MC x GEMM_TILE_N macro-tile of C against the current slab
+static void blocked_macro_tile(void *arg, int tile, int worker)
+{
+    blocked_gemm *g = arg;
+    int tiles_n = (g->nc + GEMM_TILE_N - 1) / GEMM_TILE_N;
+    int ic = (tile / tiles_n) * GEMM_MC;
+    int jt = (tile % tiles_n) * GEMM_TILE_N;
+    int mc = min(GEMM_MC, g->m - ic);
+    int kc = g->kc;
+    double *packed_A = g->packed_A[worker];
+    double edge[GEMM_MR * GEMM_NR];
+
+    // Neighbouring tiles share a block of A, so only repack when it changes
+    if (g->packed_ic[worker] != ic) {
+        pack_A(mc, kc, &g->A[ic * g->lda + g->pc], g->lda, packed_A);
+        g->packed_ic[worker] = ic;
+    }
+
+    for (int jr = jt; jr < min(jt + GEMM_TILE_N, g->nc); jr += GEMM_NR) {
+        int nr = min(GEMM_NR, g->nc - jr);
+        for (int ir = 0; ir < mc; ir += GEMM_MR) {
+            int mr = min(GEMM_MR, mc - ir);
+            double *c = &g->C[(ic + ir) * g->ldc + g->jc + jr];
+            const double *a = &packed_A[ir * kc];
+            const double *b = &g->packed_B[jr * kc];
+
+            if (mr == GEMM_MR && nr == GEMM_NR) {
+                micro_kernel(kc, a, b, c, g->ldc, g->alpha);
+            } else {
+                // Partial tile, go through a full-size scratch tile
+                for (int r = 0; r < GEMM_MR * GEMM_NR; r++)
+                    edge[r] = 0.0;
+                micro_kernel(kc, a, b, edge, GEMM_NR, g->alpha);
+                for (int r = 0; r < mr; r++)
+                    for (int q = 0; q < nr; q++)
+                        c[r * g->ldc + q] += edge[r * GEMM_NR + q];
+            }
+        }
+    }
+}
+
+// Row-major C = alpha * A * B + beta * C using the packed, register-blocked kernels.
+// Runs on the thread pool p, or on an OpenMP team if p is NULL.
+void gemm_blocked(thread_pool *p, int m, int n, int k, double alpha, const double *A, int lda,
+        const double *B, int ldb, double beta, double *C, int ldc)
+{
+    int workers = p ? p->num_workers : omp_get_max_threads();
+    blocked_gemm g = {
+        .m = m, .n = n, .k = k, .lda = lda, .ldb = ldb, .ldc = ldc,
+        .alpha = alpha, .beta = beta, .A = A, .B = B, .C = C,
+    };
+
+    g.packed_B = gemm_alloc(sizeof(double) * GEMM_KC * (GEMM_NC + GEMM_NR));
+    g.packed_A = malloc(sizeof(double *) * workers);
+    g.packed_ic = malloc(sizeof(int) * workers);
+    for (int w = 0; w < workers; w++)
+        g.packed_A[w] = gemm_alloc(sizeof(double) * (GEMM_MC + GEMM_MR) * GEMM_KC);
 
-    for(i = 0; i < num_threads; ++i){
-        thread_nums[i] = i;
-        pthread_create(&threads[i], NULL, (void*)calc_matrix_part, &thread_nums[i]);
+    parallel_for(p, m, blocked_scale_row, &g);
+
+    for (g.jc = 0; g.jc < n; g.jc += GEMM_NC) {
+        g.nc = min(GEMM_NC, n - g.jc);
+        for (g.pc = 0; g.pc < k; g.pc += GEMM_KC) {
+            g.kc = min(GEMM_KC, k - g.pc);
+            for (int w = 0; w < workers; w++)
+                g.packed_ic[w] = -1;
+
+            parallel_for(p, (g.nc + GEMM_NR - 1) / GEMM_NR, blocked_pack_B, &g);
+            parallel_for(p, ((m + GEMM_MC - 1) / GEMM_MC) * ((g.nc + GEMM_TILE_N - 1) / GEMM_TILE_N),
+                    blocked_macro_tile, &g);
+        }
     }
-    for(i = 0; i < num_threads; ++i){
-        pthread_join(threads[i], NULL);
+
+    for (int w = 0; w < workers; w++)
+        free(g.packed_A[w]);
+    free(g.packed_A);
+    free(g.packed_ic);
+    free(g.packed_B);
+}
+
+//--------------------------------------------------------------------------
+//------------------------variants------------------------------------------
+//--------------------------------------------------------------------------
+/*
+ * DGEMM (Double-precision GEneral Matrix Multiply)
+ * Example: A general multiplication between two matricies A and B, accumulating in C.
+ */
+// A has m rows and k columns
+// B has k rows and n columns
+// C has m rows and n columns
+void gemm_manual(void)
+{
+    naive_gemm(C_serial, 0, m, 0, n);
+}
+
+//TODO: OpenMP
+void gemm_openmp(void)
+{
+    #pragma omp parallel for
+    for (int i = 0; i < m; i++) {
+        naive_gemm(C_openmp, i, i + 1, 0, n);
     }
+}
+//TODO end
 
-    gettimeofday ( &end, NULL );
-    total_time_pthreads = (WALLTIME(end)-WALLTIME(start));
+//TODO: Pthreads - spawn threads
+// The pool threads already exist, each call only hands out tiles
+void gemm_pthreads(void)
+{
+    int num_tiles = ((m + TILE_ROWS - 1) / TILE_ROWS) * ((n + TILE_COLS - 1) / TILE_COLS);
+    pool_run(pool, num_tiles, calc_matrix_part, NULL);
+}
 //TODO end
 
-    gettimeofday( &start, NULL );
+void gemm_blas(void)
+{
+    if (precision == PREC_F32) {
+        cblas_sgemm(CblasRowMajor, CblasNoTrans, CblasNoTrans, m, n, k,
+                (float)alpha, A_lp, k, B_lp, n, (float)beta, (float *)C_blas, n);
+        return;
+    }
+#ifdef HAVE_SBGEMM
+    // Needs an OpenBLAS built with BUILD_BFLOAT16=1, distro packages usually are not
+    if (precision == PREC_BF16) {
+        cblas_sbgemm(CblasRowMajor, CblasNoTrans, CblasNoTrans, m, n, k,
+                (float)alpha, A_lp, k, B_lp, n, (float)beta, (float *)C_blas, n);
+        return;
+    }
+#endif
+
     // Documentation for GEMM:
     // https://software.intel.com/content/www/us/en/develop/documentation/onemkl-developer-reference-c/top/blas-and-sparse-blas-routines/blas-routines/blas-level-3-routines/cblas-gemm.html
     cblas_dgemm(
@@ -202,64 +809,797 @@ int main ( int argc, char **argv )
     	C_blas, 		// The C matrix, this is also the output matrix
     	n		// Leading dimension of C, n if CblasRowMajor
     );
-    gettimeofday ( &end, NULL );
-    //print_matrices();
-    total_time_blas = (WALLTIME(end)-WALLTIME(start));
-
-
-    bool openmp_correct = true;
-    bool pthreads_correct = true;
-    bool blas_correct = true;
-
-    for(i = 0; i < m; i++){
-        for(j = 0; j < n; j++){
-            if(C_openmp[i*n+j] != C_serial[i*n+j])
-                openmp_correct = false;
-            if(C_pthreads[i*n+j] != C_serial[i*n+j])
-                pthreads_correct = false;
-            if(C_blas[i*n+j] != C_serial[i*n+j])
-                blas_correct = false;
+}
+
+void gemm_blocked_pool(void)
+{
+    gemm_blocked(pool, m, n, k, alpha, A, k, B, n, beta, C_blocked, n);
+}
+
+
+//--------------------------------------------------------------------------
+//------------------------batched small GEMM--------------------------------
+//--------------------------------------------------------------------------
+/*
+ * Many independent small products. Each matrix is far too small to split,
+ * so the batch itself is divided over the workers, and every product runs
+ * single threaded with no packing. Square sizes that come up a lot get an
+ * FMA kernel with the dimensions known at compile time, so the loops are
+ * fully unrolled and the tile of C is kept in registers.
+ */
+typedef void (*small_gemm_fn)(int m, int n, int k, double alpha, const double *A, int lda,
+        const double *B, int ldb, double beta, double *C, int ldc);
+
+// Plain i-p-j order, the inner loop is contiguous in B and C
+static void small_gemm_scalar(int m, int n, int k, double alpha, const double *A, int lda,
+        const double *B, int ldb, double beta, double *C, int ldc)
+{
+    for (int i = 0; i < m; i++) {
+        double *c = &C[i * ldc];
+        for (int j = 0; j < n; j++)
+            c[j] = (beta == 0.0) ? 0.0 : beta * c[j];
+        for (int p = 0; p < k; p++) {
+            double a = alpha * A[i * lda + p];
+            for (int j = 0; j < n; j++)
+                c[j] += a * B[p * ldb + j];
+        }
+    }
+}
+
+#ifdef GEMM_VLEN
+#define SMALL_MB 4      // Rows of C per register tile
+#define SMALL_NV 4      // Most vectors of C per row of the register tile
+
+/*
+ * One SMALL_MB x (nv * GEMM_VLEN) tile of C, A, B and C already point at it.
+ * Always inlined with a constant nv, so the tile of C lives in registers,
+ * and with a constant K as well when the size is fixed.
+ */
+static inline __attribute__((always_inline)) void small_gemm_tile(const int nv, const int K,
+        double alpha, const double *A, int lda, const double *B, int ldb, double beta, double *C, int ldc)
+{
+    gemm_vec acc[SMALL_MB][SMALL_NV];
+    for (int r = 0; r < SMALL_MB; r++)
+        for (int v = 0; v < nv; v++)
+            acc[r][v] = gemm_vzero();
+
+    for (int p = 0; p < K; p++) {
+        gemm_vec bv[SMALL_NV];
+        for (int v = 0; v < nv; v++)
+            bv[v] = gemm_vloadu(&B[p * ldb + v * GEMM_VLEN]);
+        for (int r = 0; r < SMALL_MB; r++) {
+            gemm_vec av = gemm_vbcast(A[r * lda + p]);
+            for (int v = 0; v < nv; v++)
+                acc[r][v] = gemm_vfma(av, bv[v], acc[r][v]);
+        }
+    }
+
+    gemm_vec va = gemm_vbcast(alpha), vb = gemm_vbcast(beta);
+    for (int r = 0; r < SMALL_MB; r++)
+        for (int v = 0; v < nv; v++) {
+            double *c = &C[r * ldc + v * GEMM_VLEN];
+            gemm_vec old = (beta == 0.0) ? gemm_vzero() : gemm_vmul(vb, gemm_vloadu(c));
+            gemm_vstoreu(c, gemm_vfma(va, acc[r][v], old));
+        }
+}
+
+// Square S x S x S with S a multiple of SMALL_MB and GEMM_VLEN, every bound a constant
+#define DEFINE_SMALL_GEMM(S)                                                    \
+static void small_gemm_##S(int m, int n, int k, double alpha, const double *A, int lda, \
+        const double *B, int ldb, double beta, double *C, int ldc)              \
+{                                                                               \
+    const int nv = max(1, min(SMALL_NV, S / GEMM_VLEN));                        \
+    for (int i0 = 0; i0 < S; i0 += SMALL_MB)                                    \
+        for (int j0 = 0; j0 < S; j0 += nv * GEMM_VLEN)                          \
+            small_gemm_tile(nv, S, alpha, &A[i0 * lda], lda, &B[j0], ldb,       \
+                    beta, &C[i0 * ldc + j0], ldc);                              \
+}
+
+DEFINE_SMALL_GEMM(4)
+DEFINE_SMALL_GEMM(8)
+DEFINE_SMALL_GEMM(16)
+DEFINE_SMALL_GEMM(32)
+DEFINE_SMALL_GEMM(64)
+
+// Any size: register tiles where they fit, the scalar loop for the right and bottom edges
+static void small_gemm_any(int m, int n, int k, double alpha, const double *A, int lda,
+        const double *B, int ldb, double beta, double *C, int ldc)
+{
+    int m_full = m - m % SMALL_MB;
+    int n_full = n - n % GEMM_VLEN;
+
+    for (int i0 = 0; i0 < m_full; i0 += SMALL_MB) {
+        int j0 = 0;
+        for (; j0 + 2 * GEMM_VLEN <= n_full; j0 += 2 * GEMM_VLEN)
+            small_gemm_tile(2, k, alpha, &A[i0 * lda], lda, &B[j0], ldb, beta, &C[i0 * ldc + j0], ldc);
+        for (; j0 < n_full; j0 += GEMM_VLEN)
+            small_gemm_tile(1, k, alpha, &A[i0 * lda], lda, &B[j0], ldb, beta, &C[i0 * ldc + j0], ldc);
+    }
+    small_gemm_scalar(m_full, n - n_full, k, alpha, A, lda, &B[n_full], ldb, beta, &C[n_full], ldc);
+    small_gemm_scalar(m - m_full, n, k, alpha, &A[m_full * lda], lda, B, ldb, beta, &C[m_full * ldc], ldc);
+}
+#else
+#define small_gemm_any small_gemm_scalar
+#endif
+
+static small_gemm_fn small_gemm_select(int m, int n, int k)
+{
+#ifdef GEMM_VLEN
+    if (m == n && n == k && m % GEMM_VLEN == 0) {
+        switch (m) {
+        case 4:  return small_gemm_4;
+        case 8:  return small_gemm_8;
+        case 16: return small_gemm_16;
+        case 32: return small_gemm_32;
+        case 64: return small_gemm_64;
+        }
+    }
+#endif
+    return small_gemm_any;
+}
+
+typedef struct {
+    small_gemm_fn kernel;
+    int m, n, k, lda, ldb, ldc, batch, chunk;
+    double alpha, beta;
+    const double *A, *B;        // Strided form
+    double *C;
+    long stride_a, stride_b, stride_c;
+    const double **A_array, **B_array;    // Pointer-array form, used when A_array != NULL
+    double **C_array;
+} batch_gemm;
+
+// Products [task * chunk, (task + 1) * chunk) of the batch
+static void batch_gemm_chunk(void *arg, int task, int worker)
+{
+    batch_gemm *g = arg;
+    int end = min((task + 1) * g->chunk, g->batch);
+    for (int b = task * g->chunk; b < end; b++) {
+        if (g->A_array)
+            g->kernel(g->m, g->n, g->k, g->alpha, g->A_array[b], g->lda, g->B_array[b], g->ldb,
+                    g->beta, g->C_array[b], g->ldc);
+        else
+            g->kernel(g->m, g->n, g->k, g->alpha, g->A + b * g->stride_a, g->lda,
+                    g->B + b * g->stride_b, g->ldb, g->beta, g->C + b * g->stride_c, g->ldc);
+    }
+}
+
+static void batch_gemm_run(thread_pool *p, batch_gemm *g)
+{
+    int workers = p ? p->num_workers : omp_get_max_threads();
+    // A few chunks per worker leaves something to steal without paying per matrix
+    g->kernel = small_gemm_select(g->m, g->n, g->k);
+    g->chunk = max(1, g->batch / (workers * 4));
+    parallel_for(p, (g->batch + g->chunk - 1) / g->chunk, batch_gemm_chunk, g);
+}
+
+// C_b = alpha * A_b * B_b + beta * C_b for b in [0, batch), matrix b at base + b * stride
+void gemm_batch_strided(thread_pool *p, int m, int n, int k, double alpha,
+        const double *A, int lda, long stride_a, const double *B, int ldb, long stride_b,
+        double beta, double *C, int ldc, long stride_c, int batch)
+{
+    batch_gemm g = {
+        .m = m, .n = n, .k = k, .lda = lda, .ldb = ldb, .ldc = ldc, .batch = batch,
+        .alpha = alpha, .beta = beta, .A = A, .B = B, .C = C,
+        .stride_a = stride_a, .stride_b = stride_b, .stride_c = stride_c,
+    };
+    batch_gemm_run(p, &g);
+}
+
+// C[b] = alpha * A[b] * B[b] + beta * C[b] for b in [0, batch), matrices anywhere in memory
+void gemm_batch(thread_pool *p, int m, int n, int k, double alpha,
+        const double **A, int lda, const double **B, int ldb,
+        double beta, double **C, int ldc, int batch)
+{
+    batch_gemm g = {
+        .m = m, .n = n, .k = k, .lda = lda, .ldb = ldb, .ldc = ldc, .batch = batch,
+        .alpha = alpha, .beta = beta, .A_array = A, .B_array = B, .C_array = C,
+    };
+    batch_gemm_run(p, &g);
+}
+
+// Pointer arrays for the batched benchmark, set up untimed
+const double **A_batch, **B_batch;
+double **C_batch;
+
+void gemm_blas_loop(void)
+{
+    for (int b = 0; b < batch; b++)
+        cblas_dgemm(CblasRowMajor, CblasNoTrans, CblasNoTrans, m, n, k,
+                alpha, A + (long)b * m * k, k, B + (long)b * k * n, n, beta, C_blas + (long)b * m * n, n);
+}
+
+void gemm_batch_strided_pool(void)
+{
+    gemm_batch_strided(pool, m, n, k, alpha, A, k, (long)m * k, B, n, (long)k * n,
+            beta, C_batch_strided, n, (long)m * n, batch);
+}
+
+void gemm_batch_ptr_pool(void)
+{
+    gemm_batch(pool, m, n, k, alpha, A_batch, k, B_batch, n, beta, C_batch, n, batch);
+}
+
+
+//--------------------------------------------------------------------------
+//------------------------recursive and Strassen GEMM-----------------------
+//--------------------------------------------------------------------------
+/*
+ * Cache-oblivious C = A * B: halve the largest dimension until every block
+ * fits the register-tiled small kernel, so each level of the cache gets
+ * a block that fits it without any tuning. Splits of m and n write
+ * disjoint parts of C and run as OpenMP tasks, splits of k run in order.
+ *
+ * Above strassen_cutoff (every dimension at least that large) one level of
+ * Strassen-Winograd replaces 8 half size products by 7 plus 15 additions,
+ * and recurses. The 7 products are independent tasks, each with its own
+ * part of one scratch arena sized up front, so nothing is allocated below
+ * the top call. Each Strassen level costs some accuracy, the error column
+ * of the benchmark shows how much.
+ *
+ * Uses OpenMP tasks rather than the pool, the pool cannot wait on work
+ * submitted from inside a task.
+ */
+#define RECURSIVE_BASE 64               // Largest block handed to the small kernel
+#define RECURSIVE_TASK_WORK (1L << 21)  // m * n * k below which splits are not worth a task
+
+int strassen_cutoff = 1024;     // 0 leaves only the cache-oblivious recursion
+bool run_recursive = false;
+double *C_recursive;
+
+// C = A * B, or C += A * B when accumulate
+static void gemm_recursive(int m, int n, int k, const double *A, int lda,
+        const double *B, int ldb, double *C, int ldc, bool accumulate)
+{
+    if (m <= RECURSIVE_BASE && n <= RECURSIVE_BASE && k <= RECURSIVE_BASE) {
+        small_gemm_any(m, n, k, 1.0, A, lda, B, ldb, accumulate ? 1.0 : 0.0, C, ldc);
+        return;
+    }
+    bool spawn = (long)m * n * k >= RECURSIVE_TASK_WORK;
+
+    if (m >= n && m >= k) {
+        int h = m / 2;
+        #pragma omp task if (spawn)
+        gemm_recursive(h, n, k, A, lda, B, ldb, C, ldc, accumulate);
+        gemm_recursive(m - h, n, k, &A[h * lda], lda, B, ldb, &C[h * ldc], ldc, accumulate);
+        #pragma omp taskwait
+    } else if (n >= k) {
+        int h = n / 2;
+        #pragma omp task if (spawn)
+        gemm_recursive(m, h, k, A, lda, B, ldb, C, ldc, accumulate);
+        gemm_recursive(m, n - h, k, A, lda, &B[h], ldb, &C[h], ldc, accumulate);
+        #pragma omp taskwait
+    } else {
+        int h = k / 2;
+        gemm_recursive(m, n, h, A, lda, B, ldb, C, ldc, accumulate);
+        gemm_recursive(m, n, k - h, &A[h], lda, &B[h * ldb], ldb, C, ldc, true);
+    }
+}
+
+static bool use_strassen(int m, int n, int k)
+{
+    return strassen_cutoff > 0 && m >= strassen_cutoff && n >= strassen_cutoff && k >= strassen_cutoff;
+}
+
+// Doubles of scratch a Strassen node needs: S1-S4, T1-T4, P1, P6, P7 and the arenas of its 7 children
+static size_t strassen_scratch(int m, int n, int k)
+{
+    if (!use_strassen(m, n, k))
+        return 0;
+    size_t hm = m / 2, hn = n / 2, hk = k / 2;
+    return 4 * hm * hk + 4 * hk * hn + 3 * hm * hn + 7 * strassen_scratch(hm, hn, hk);
+}
+
+static void gemm_strassen_node(int m, int n, int k, const double *A, int lda,
+        const double *B, int ldb, double *C, int ldc, double *scratch)
+{
+    if (!use_strassen(m, n, k)) {
+        gemm_recursive(m, n, k, A, lda, B, ldb, C, ldc, false);
+        return;
+    }
+
+    // Quadrants of the even part, a trailing odd row or column is fixed up at the end
+    int hm = m / 2, hn = n / 2, hk = k / 2;
+    const double *A11 = A, *A12 = &A[hk], *A21 = &A[hm * lda], *A22 = &A[hm * lda + hk];
+    const double *B11 = B, *B12 = &B[hn], *B21 = &B[hk * ldb], *B22 = &B[hk * ldb + hn];
+    double *C11 = C, *C12 = &C[hn], *C21 = &C[hm * ldc], *C22 = &C[hm * ldc + hn];
+
+    size_t a_size = (size_t)hm * hk, b_size = (size_t)hk * hn, c_size = (size_t)hm * hn;
+    double *S1 = scratch, *S2 = S1 + a_size, *S3 = S2 + a_size, *S4 = S3 + a_size;
+    double *T1 = S4 + a_size, *T2 = T1 + b_size, *T3 = T2 + b_size, *T4 = T3 + b_size;
+    double *P1 = T4 + b_size, *P6 = P1 + c_size, *P7 = P6 + c_size;
+    double *child = P7 + c_size;
+    size_t child_size = strassen_scratch(hm, hn, hk);
+
+    for (int i = 0; i < hm; i++)
+        for (int p = 0; p < hk; p++) {
+            size_t s = (size_t)i * hk + p;
+            double a11 = A11[i * lda + p], a12 = A12[i * lda + p];
+            double a21 = A21[i * lda + p], a22 = A22[i * lda + p];
+            S1[s] = a21 + a22;
+            S2[s] = S1[s] - a11;
+            S3[s] = a11 - a21;
+            S4[s] = a12 - S2[s];
+        }
+    for (int p = 0; p < hk; p++)
+        for (int j = 0; j < hn; j++) {
+            size_t t = (size_t)p * hn + j;
+            double b11 = B11[p * ldb + j], b12 = B12[p * ldb + j];
+            double b21 = B21[p * ldb + j], b22 = B22[p * ldb + j];
+            T1[t] = b12 - b11;
+            T2[t] = b22 - T1[t];
+            T3[t] = b22 - b12;
+            T4[t] = T2[t] - b21;
+        }
+
+    // P2 to P5 go straight into the quadrant of C they end up in
+    #pragma omp task
+    gemm_strassen_node(hm, hn, hk, A11, lda, B11, ldb, P1, hn, child);
+    #pragma omp task
+    gemm_strassen_node(hm, hn, hk, A12, lda, B21, ldb, C11, ldc, child + child_size);
+    #pragma omp task
+    gemm_strassen_node(hm, hn, hk, S4, hk, B22, ldb, C12, ldc, child + 2 * child_size);
+    #pragma omp task
+    gemm_strassen_node(hm, hn, hk, A22, lda, T4, hn, C21, ldc, child + 3 * child_size);
+    #pragma omp task
+    gemm_strassen_node(hm, hn, hk, S1, hk, T1, hn, C22, ldc, child + 4 * child_size);
+    #pragma omp task
+    gemm_strassen_node(hm, hn, hk, S2, hk, T2, hn, P6, hn, child + 5 * child_size);
+    gemm_strassen_node(hm, hn, hk, S3, hk, T3, hn, P7, hn, child + 6 * child_size);
+    #pragma omp taskwait
+
+    for (int i = 0; i < hm; i++)
+        for (int j = 0; j < hn; j++) {
+            size_t t = (size_t)i * hn + j;
+            double p1 = P1[t], p2 = C11[i * ldc + j], p3 = C12[i * ldc + j];
+            double p4 = C21[i * ldc + j], p5 = C22[i * ldc + j];
+            double u2 = p1 + P6[t], u3 = u2 + P7[t];
+            C11[i * ldc + j] = p1 + p2;
+            C12[i * ldc + j] = u2 + p5 + p3;
+            C21[i * ldc + j] = u3 - p4;
+            C22[i * ldc + j] = u3 + p5;
+        }
+
+    // Odd k adds a rank-1 term to the even part, odd n and m leave a column and a row of C
+    if (k > 2 * hk)
+        gemm_recursive(2 * hm, 2 * hn, 1, &A[2 * hk], lda, &B[2 * hk * ldb], ldb, C, ldc, true);
+    if (n > 2 * hn)
+        gemm_recursive(2 * hm, 1, k, A, lda, &B[2 * hn], ldb, &C[2 * hn], ldc, false);
+    if (m > 2 * hm)
+        gemm_recursive(1, n, k, &A[2 * hm * lda], lda, B, ldb, &C[2 * hm * ldc], ldc, false);
+}
+
+// C = A * B through the recursion above, with Strassen-Winograd levels while every dimension >= strassen_cutoff
+void gemm_strassen(int m, int n, int k, const double *A, int lda,
+        const double *B, int ldb, double *C, int ldc)
+{
+    // Kept between calls, so the timed runs do not pay for the allocation
+    static double *arena = NULL;
+    static size_t arena_size = 0;
+
+    size_t need = strassen_scratch(m, n, k);
+    if (need > arena_size) {
+        free(arena);
+        arena = gemm_alloc(need * sizeof(double));
+        arena_size = need;
+    }
+
+    #pragma omp parallel
+    #pragma omp single
+    gemm_strassen_node(m, n, k, A, lda, B, ldb, C, ldc, arena);
+}
+
+void gemm_recursive_omp(void)
+{
+    gemm_strassen(m, n, k, A, k, B, n, C_recursive, n);
+}
+
+typedef struct {
+    const char *name;
+    void (*run)(void);
+    double **C;
+    bool *enabled;
+    unsigned precisions;        // Bit mask of the precision_t values it implements
+} variant;
+
+#define ALL_PRECISIONS ((1u << PREC_F64) | (1u << PREC_F32) | (1u << PREC_BF16))
+#ifdef HAVE_SBGEMM
+#define BLAS_PRECISIONS ALL_PRECISIONS
+#else
+#define BLAS_PRECISIONS ((1u << PREC_F64) | (1u << PREC_F32))
+#endif
+
+bool always = true;
+
+// The manual variant comes first, it is the reference the others are checked against
+variant variants[] = {
+    { "Manual",   gemm_manual,       &C_serial,   &always,      ALL_PRECISIONS },
+    { "OpenMP",   gemm_openmp,       &C_openmp,   &always,      ALL_PRECISIONS },
+    { "Pthreads", gemm_pthreads,     &C_pthreads, &always,      ALL_PRECISIONS },
+    { "BLAS",     gemm_blas,         &C_blas,     &always,      BLAS_PRECISIONS },
+    { "Blocked",  gemm_blocked_pool, &C_blocked,  &run_blocked, 1u << PREC_F64 },
+    { "Recursive", gemm_recursive_omp, &C_recursive, &run_recursive, 1u << PREC_F64 },
+};
+
+// Batched mode, a plain loop of cblas_dgemm calls is the reference
+variant batch_variants[] = {
+    { "BLAS loop", gemm_blas_loop,          &C_blas,          &always, 1u << PREC_F64 },
+    { "Strided",   gemm_batch_strided_pool, &C_batch_strided, &always, 1u << PREC_F64 },
+    { "Pointers",  gemm_batch_ptr_pool,     &C_batch_ptr,     &always, 1u << PREC_F64 },
+};
+
+variant *bench_table = variants;
+int bench_table_size = sizeof(variants) / sizeof(variants[0]);
+
+
+//--------------------------------------------------------------------------
+//------------------------benchmark harness---------------------------------
+//--------------------------------------------------------------------------
+static double monotonic_seconds(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (double)t.tv_sec + 1e-9 * (double)t.tv_nsec;
+}
+
+static int compare_doubles(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+typedef struct {
+    double median, p95, min;
+    double gflops, gbytes;
+    double max_rel_err;
+    bool correct;
+} bench_result;
+
+// Warm up, then time `reps` calls and summarise them
+static bench_result bench_variant(variant const *v, int warm, int reps)
+{
+    bench_result res;
+    double *times = malloc(sizeof(double) * reps);
+
+    for (int r = 0; r < warm; r++)
+        v->run();
+    for (int r = 0; r < reps; r++) {
+        double start = monotonic_seconds();
+        v->run();
+        times[r] = monotonic_seconds() - start;
+    }
+
+    qsort(times, reps, sizeof(double), compare_doubles);
+    res.min = times[0];
+    res.median = (reps % 2) ? times[reps / 2] : 0.5 * (times[reps / 2 - 1] + times[reps / 2]);
+    res.p95 = times[(int)ceil(0.95 * reps) - 1];     // Nearest rank
+    free(times);
+
+    // Compulsory traffic only: A and B read once, C written once
+    res.gflops = 2.0 * m * n * k * batch / res.median * 1e-9;
+    res.gbytes = ((double)input_size() * ((double)m * k + (double)k * n)
+            + (double)output_size() * m * n) * batch / res.median * 1e-9;
+    return res;
+}
+
+// Max |C - C_ref| relative to max |C_ref|, so the check does not depend on summation order.
+// C_ref is always f64, so for f32/bf16 this is the error of the precision itself.
+static void check_variant(double const *C, bench_result *res)
+{
+    double max_diff = 0.0, max_ref = 0.0;
+    for (long i = 0; i < (long)m * n * batch; i++) {
+        max_diff = max(max_diff, fabs(c_at(C, i) - C_ref[i]));
+        max_ref = max(max_ref, fabs(C_ref[i]));
+    }
+    res->max_rel_err = max_ref > 0.0 ? max_diff / max_ref : max_diff;
+    res->correct = res->max_rel_err <= (tolerance < 0.0 ? precision_tolerance[precision] : tolerance);
+}
+
+// layout_base is the median of the same variant with the serial layout, 0 if there is none
+static void report(FILE *out, variant const *v, int threads, bench_result const *res, double serial_time,
+        double layout_base)
+{
+    const char *layout = first_touch ? "first-touch" : "serial";
+    const char *pinning = pin_threads ? affinity_names[affinity] : "none";
+
+    static bool csv_header = false;
+
+    switch (output_format) {
+    case OUT_TEXT:
+        if (v == &bench_table[0] && precision == PREC_F64) {
+            printf("%-9s\t\tMedian:\t%es\t", v->name, res->median);
+            printf("p95: %es\tGFLOP/s: %.2lf\tGB/s: %.2lf\n", res->p95, res->gflops, res->gbytes);
+            break;
+        }
+        printf("%-9s %s\t", v->name, res->correct ? "CORRECT" : "INCORRECT");
+        printf("Median:\t%es\tp95: %es\t", res->median, res->p95);
+        printf("GFLOP/s: %.2lf\tGB/s: %.2lf\t", res->gflops, res->gbytes);
+        printf("Speedup: %.2lfx\tErr: %.1e", serial_time / res->median, res->max_rel_err);
+        if (layout_base > 0.0)
+            printf("\tNUMA: %.2lfx", layout_base / res->median);
+        printf("\n");
+        break;
+    case OUT_CSV:
+        if (!csv_header) {
+            fprintf(out, "variant,precision,m,n,k,batch,threads,layout,affinity,warmups,reps,median_s,p95_s,min_s,gflops,gbytes_s,max_rel_err,correct,compiler\n");
+            csv_header = true;
         }
+        fprintf(out, "%s,%s,%d,%d,%d,%d,%d,%s,%s,%d,%d,%e,%e,%e,%.4lf,%.4lf,%e,%d,\"%s\"\n",
+                v->name, precision_names[precision], m, n, k, batch, threads, layout, pinning,
+                warmups, repeats,
+                res->median, res->p95, res->min,
+                res->gflops, res->gbytes, res->max_rel_err, res->correct, __VERSION__);
+        break;
+    case OUT_JSON:
+        fprintf(out, "{\"variant\":\"%s\",\"precision\":\"%s\",\"m\":%d,\"n\":%d,\"k\":%d,\"batch\":%d,\"threads\":%d,"
+                "\"layout\":\"%s\",\"affinity\":\"%s\","
+                "\"warmups\":%d,\"reps\":%d,\"median_s\":%e,\"p95_s\":%e,\"min_s\":%e,"
+                "\"gflops\":%.4lf,\"gbytes_s\":%.4lf,\"max_rel_err\":%e,\"correct\":%s,"
+                "\"compiler\":\"%s\"}\n",
+                v->name, precision_names[precision], m, n, k, batch, threads, layout, pinning,
+                warmups, repeats,
+                res->median, res->p95, res->min,
+                res->gflops, res->gbytes, res->max_rel_err, res->correct ? "true" : "false",
+                __VERSION__);
+        break;
+    }
+}
+
+static void set_batch_pointers(void)
+{
+    for (int b = 0; b < batch; b++) {
+        A_batch[b] = A + (long)b * m * k;
+        B_batch[b] = B + (long)b * k * n;
+        C_batch[b] = C_batch_ptr + (long)b * m * n;
     }
+}
+
+// Allocate and fill the matrices for the current m, n, k.
+// Everything is touched by the main thread, so all pages land on its node.
+static void setup_matrices(void)
+{
+    A = (double *)malloc( (size_t)m*k*batch*sizeof( double ) );
+    B = (double *)malloc( (size_t)k*n*batch*sizeof( double ) );
+    for (int v = 0; v < bench_table_size; v++)
+        *bench_table[v].C = (double *)malloc( (size_t)m*n*batch*sizeof( double ) );
+
+    /* Initialize with dummy data */
+    for ( long i = 0; i < ((long)m*k*batch); i++ )
+        A[i] = (double)(i+1);
+    for ( long i = 0; i < ((long)k*n*batch); i++ )
+        B[i] = (double)(-i-1);
+    for (int v = 0; v < bench_table_size; v++)
+        memset(*bench_table[v].C, 0, (size_t)m*n*batch*sizeof( double ));
+
+    if (batch > 1) {
+        A_batch = malloc(sizeof(double *) * batch);
+        B_batch = malloc(sizeof(double *) * batch);
+        C_batch = malloc(sizeof(double *) * batch);
+        set_batch_pointers();
+    }
+
+    convert_inputs();
+}
 
-    printf ( "Manual\t\t\tTime:\t%es\n", total_time_serial );
+// Copy buf into fresh pages. In parallel the OpenMP team splits the pages
+// the same way it and the pool split rows, so each thread touches its own first.
+static void *move_buffer(void *buf, size_t bytes, bool parallel)
+{
+    const long page = sysconf(_SC_PAGESIZE);
+    char *dst = aligned_alloc(page, (bytes + page - 1) / page * page);
+    char const *src = buf;
 
-    printf("OpenMP:\t  %s\t", openmp_correct ? "CORRECT" : "INCORRECT");
-    printf ( "Time:\t%es\t", total_time_openmp );
-    printf ( "Speedup: %.2lfx\n", total_time_serial/total_time_openmp );
+    #pragma omp parallel for schedule(static) if (parallel)
+    for (long i = 0; i < (long)bytes; i += page)
+        memcpy(dst + i, src + i, min(page, (long)bytes - i));
 
-    printf("Pthreads: %s\t", pthreads_correct ? "CORRECT" : "INCORRECT");
-    printf ( "Time:\t%es\t", total_time_pthreads );
-    printf ( "Speedup: %.2lfx\n", total_time_serial/total_time_pthreads );
+    free(buf);
+    return dst;
+}
 
-    printf("BLAS:\t  %s\t", blas_correct ? "CORRECT" : "INCORRECT");
-    printf ( "Time:\t%es\t", total_time_blas );
-    printf ( "Speedup: %.2lfx\n", total_time_serial/total_time_blas );
+// Re-place the inputs and every output but the reference, first-touch or from the main thread
+static void relayout(bool parallel)
+{
+    A = move_buffer(A, (size_t)m*k*batch*sizeof( double ), parallel);
+    B = move_buffer(B, (size_t)k*n*batch*sizeof( double ), parallel);
+    if (precision != PREC_F64) {
+        A_lp = move_buffer(A_lp, (size_t)m*k*input_size(), parallel);
+        B_lp = move_buffer(B_lp, (size_t)k*n*input_size(), parallel);
+    }
+    for (int v = 1; v < bench_table_size; v++)
+        *bench_table[v].C = move_buffer(*bench_table[v].C, (size_t)m*n*batch*sizeof( double ), parallel);
+    if (batch > 1)
+        set_batch_pointers();
+}
 
+static void free_matrices(void)
+{
     free ( A );
     free ( B );
-    free ( C_serial );
-    free ( C_openmp );
-    free ( C_pthreads );
-    free ( C_blas );
+    for (int v = 0; v < bench_table_size; v++)
+        free ( *bench_table[v].C );
+    if (batch > 1) {
+        free ( A_batch );
+        free ( B_batch );
+        free ( C_batch );
+    }
+    if (precision != PREC_F64) {
+        free ( A_lp );
+        free ( B_lp );
+        free ( C_ref );
+    }
+}
+
+int main ( int argc, char **argv )
+{
+    options ( argc, argv );
+    init_worker_cpus();
+
+    if (batch > 1) {
+        if (precision != PREC_F64) {
+            fprintf ( stderr, "Batched mode is f64 only\n" );
+            exit ( EXIT_FAILURE );
+        }
+        bench_table = batch_variants;
+        bench_table_size = sizeof(batch_variants) / sizeof(batch_variants[0]);
+    }
+
+    FILE *out = stdout;
+    if (output_file && output_format != OUT_TEXT) {
+        out = fopen(output_file, "a");
+        if (out == NULL) {
+            perror(output_file);
+            exit ( EXIT_FAILURE );
+        }
+    }
+
+    for (int im = 0; im < num_m; im++)
+    for (int in = 0; in < num_n; in++)
+    for (int ik = 0; ik < num_k; ik++) {
+        m = sweep_m[im];
+        n = sweep_n[in];
+        k = sweep_k[ik];
+        setup_matrices();
+
+        // The manual variant does not depend on the thread count, so it is only measured once per
+        // shape, but with the same warm-up and repetitions as the others so its row compares.
+        // For f64 it is also the reference, otherwise the reference comes from cblas_dgemm.
+        // In batched mode the first entry is the cblas_dgemm loop instead.
+        bench_result serial = bench_variant(&bench_table[0], warmups, repeats);
+        if (precision == PREC_F64) {
+            C_ref = *bench_table[0].C;
+        } else {
+            C_ref = (double *)malloc( (size_t)m*n*sizeof( double ) );
+            cblas_dgemm(CblasRowMajor, CblasNoTrans, CblasNoTrans, m, n, k,
+                    alpha, A, k, B, n, beta, C_ref, n);
+        }
+        check_variant(*bench_table[0].C, &serial);
+        //print_matrices();
+
+        for (int it = 0; it < num_t; it++) {
+            num_threads = sweep_t[it];
+            omp_set_num_threads(num_threads);
+            double layout_base[bench_table_size];
+
+            // With -N the current layout (main thread touches everything, nothing pinned)
+            // is measured first and then the first-touch, pinned one. Without it, -a applies as is.
+            for (int layout = 0; layout < (numa_compare ? 2 : 1); layout++) {
+                first_touch = (layout == 1);
+                pin_threads = numa_compare ? first_touch : true;
+                pin_openmp_team(pin_threads);
+                if (numa_compare)
+                    relayout(first_touch);
+                pool = pool_create(num_threads);
+
+                if (output_format == OUT_TEXT) {
+                    printf("m=%d n=%d k=%d batch=%d threads=%d precision=%s (%d warm-up, %d timed calls)\n",
+                            m, n, k, batch, num_threads, precision_names[precision], warmups, repeats);
+                    if (numa_compare) {
+                        printf("Layout: %s, affinity %s\n", first_touch ? "first-touch" : "serial init",
+                                pin_threads ? affinity_names[affinity] : "none");
+                        report_placement("A", A, (size_t)m*k*batch*sizeof( double ));
+                        report_placement("B", B, (size_t)k*n*batch*sizeof( double ));
+                        report_placement("C (each)", *bench_table[1].C, (size_t)m*n*batch*sizeof( double ));
+                    }
+                }
+                report(out, &bench_table[0], num_threads, &serial, serial.median, 0.0);
+
+                for (int v = 1; v < bench_table_size; v++) {
+                    variant *var = &bench_table[v];
+                    if (!*var->enabled)
+                        continue;
+                    if (!(var->precisions & (1u << precision))) {
+                        if (output_format == OUT_TEXT)
+                            printf("%-9s skipped, no %s implementation\n", var->name,
+                                    precision_names[precision]);
+                        continue;
+                    }
+                    bench_result res = bench_variant(var, warmups, repeats);
+                    check_variant(*var->C, &res);
+                    report(out, var, num_threads, &res, serial.median, first_touch ? layout_base[v] : 0.0);
+                    layout_base[v] = res.median;
+                }
+
+                pool_destroy ( pool );
+                pin_openmp_team(false);
+            }
+        }
+
+        free_matrices();
+    }
+
+    if (out != stdout)
+        fclose(out);
 
     exit ( EXIT_SUCCESS );
 }
 
+// Parse "a,b,c" into list, returns the number of entries
+static int parse_sweep ( char *arg, int *list )
+{
+    int count = 0;
+    for (char *tok = strtok(arg, ","); tok != NULL && count < MAX_SWEEP; tok = strtok(NULL, ","))
+        list[count++] = strtol ( tok, NULL, 10 );
+    if (count == 0) {
+        fprintf ( stderr, "%s", usage );
+        exit ( EXIT_FAILURE );
+    }
+    return count;
+}
+
 void
 options ( int argc, char **argv )
 {
+    bool affinity_given = false;
     int o;
-    while ( (o = getopt(argc,argv,"k:m:n:t:h")) != -1 )
+    while ( (o = getopt(argc,argv,"k:m:n:t:w:r:p:e:o:f:b:a:s:Nvh")) != -1 )
     switch ( o )
     {
-        case 'k': k = strtol ( optarg, NULL, 10 ); break;
-        case 'm': m = strtol ( optarg, NULL, 10 ); break;
-        case 'n': n = strtol ( optarg, NULL, 10 ); break;
-        case 't': num_threads = strtol ( optarg, NULL, 10 ); break;
+        case 'k': num_k = parse_sweep ( optarg, sweep_k ); break;
+        case 'm': num_m = parse_sweep ( optarg, sweep_m ); break;
+        case 'n': num_n = parse_sweep ( optarg, sweep_n ); break;
+        case 't': num_t = parse_sweep ( optarg, sweep_t ); break;
+        case 'w': warmups = strtol ( optarg, NULL, 10 ); break;
+        case 'r': repeats = max ( 1, strtol ( optarg, NULL, 10 ) ); break;
+        case 'p':
+            if (strcmp(optarg, "f32") == 0)
+                precision = PREC_F32;
+            else if (strcmp(optarg, "bf16") == 0)
+                precision = PREC_BF16;
+            else
+                precision = PREC_F64;
+            break;
+        case 'e': tolerance = strtod ( optarg, NULL ); break;
+        case 'o':
+            if (strcmp(optarg, "csv") == 0)
+                output_format = OUT_CSV;
+            else if (strcmp(optarg, "json") == 0)
+                output_format = OUT_JSON;
+            break;
+        case 'f': output_file = optarg; break;
+        case 'v': run_blocked = true; break;
+        case 's':
+            run_recursive = true;
+            strassen_cutoff = max ( 0, strtol ( optarg, NULL, 10 ) );
+            break;
+        case 'b': batch = max ( 1, strtol ( optarg, NULL, 10 ) ); break;
+        case 'a':
+            if (strcmp(optarg, "compact") == 0)
+                affinity = AFFINITY_COMPACT;
+            else if (strcmp(optarg, "scatter") == 0)
+                affinity = AFFINITY_SCATTER;
+            else
+                affinity = AFFINITY_NONE;
+            affinity_given = true;
+            break;
+        case 'N': numa_compare = true; break;
         case 'h':
             fprintf ( stderr, "%s", usage );
             exit ( EXIT_FAILURE );
             break;
     }
+
+    // Comparing layouts without pinning would mostly measure the scheduler
+    if (numa_compare && !affinity_given)
+        affinity = AFFINITY_COMPACT;
 }